@@ -0,0 +1,307 @@
+/*
+    bench.c
+    Microbenchmark comparing the inline FLV number codecs in data_conv.h
+    with the original byte-by-byte versions they replaced
+    by Paul Kelly
+    Copyright (C) 2007-09 Radiomonitor Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "data_conv.h"
+
+/* Size of the buffer of random bytes decoded on each pass */
+#define BENCH_BUFFER (64 * 1024)
+/* Number of passes over the buffer per codec */
+#define BENCH_PASSES 400
+
+/* The old versions are kept out of line, as they were in data_conv.c */
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#else
+#define NOINLINE
+#endif
+
+static short byte_order_test = 1;
+#define IS_BIG_ENDIAN    (((unsigned char *) (&byte_order_test))[0] == 0)
+
+static double old_conv_double(const unsigned char *);
+static unsigned int old_conv_ui32(const unsigned char *);
+static unsigned int old_conv_ui24(const unsigned char *, unsigned char);
+static unsigned short old_conv_ui16(const unsigned char *);
+static unsigned char *old_format_double(double);
+static unsigned char *old_format_ui32(unsigned int);
+static unsigned char *old_format_ui24(unsigned int);
+static double elapsed(const struct timespec *);
+static void report(const char *, double, double);
+
+/* Results are accumulated here so the loops can't be optimised away */
+static volatile unsigned long long sink;
+
+int main(int argc, char **argv)
+{
+    unsigned char *buffer = malloc(BENCH_BUFFER + 8);
+    unsigned char out[8];
+    unsigned long long sum_old, sum_new;
+    struct timespec start;
+    double t_old, t_new;
+    size_t i;
+    int pass, mismatches = 0;
+
+    if( !buffer )
+    {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(1);
+    }
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    for( i = 0; i < BENCH_BUFFER + 8; i++ )
+        buffer[i] = rand() & 0xff;
+
+    /* Check that the two sets of codecs agree before timing them */
+    for( i = 0; i < BENCH_BUFFER; i++ )
+    {
+        const unsigned char *p = buffer + i;
+        double d = old_conv_double(p);
+
+        if( old_conv_ui32(p) != conv_ui32(p) || old_conv_ui24(p, p[3]) != conv_ui24(p, p[3]) ||
+            old_conv_ui16(p) != conv_ui16(p) || memcmp(&d, &(double){conv_double(p)}, sizeof(d)) != 0 ||
+            memcmp(old_format_ui32(conv_ui32(p)), encode_ui32(out, conv_ui32(p)) - 4, 4) != 0 ||
+            memcmp(old_format_ui24(conv_ui32(p)), encode_timestamp(out, conv_ui32(p)) - 4, 4) != 0 ||
+            memcmp(old_format_double(d), encode_double(out, d) - 8, 8) != 0 )
+            mismatches++;
+    }
+    if( mismatches )
+    {
+        fprintf(stderr, "ERROR: Old and new codecs disagree at %d offsets\n", mismatches);
+        exit(1);
+    }
+
+    printf("%-16s %10s %10s %8s\n", "codec", "old ns/op", "new ns/op", "speedup");
+
+#define BENCH_DECODE(name, old_expr, new_expr) \
+    do { \
+        sum_old = sum_new = 0; \
+        clock_gettime(CLOCK_MONOTONIC, &start); \
+        for( pass = 0; pass < BENCH_PASSES; pass++ ) \
+            for( i = 0; i < BENCH_BUFFER; i++ ) \
+            { \
+                const unsigned char *p = buffer + i; \
+                sum_old += old_expr; \
+            } \
+        t_old = elapsed(&start); \
+        clock_gettime(CLOCK_MONOTONIC, &start); \
+        for( pass = 0; pass < BENCH_PASSES; pass++ ) \
+            for( i = 0; i < BENCH_BUFFER; i++ ) \
+            { \
+                const unsigned char *p = buffer + i; \
+                sum_new += new_expr; \
+            } \
+        t_new = elapsed(&start); \
+        sink += sum_old + sum_new; \
+        report(name, t_old, t_new); \
+    } while( 0 )
+
+#define BENCH_ENCODE(name, old_expr, new_expr) \
+    do { \
+        clock_gettime(CLOCK_MONOTONIC, &start); \
+        for( pass = 0; pass < BENCH_PASSES; pass++ ) \
+            for( i = 0; i < BENCH_BUFFER; i++ ) \
+            { \
+                const unsigned char *p = buffer + i; \
+                sink += old_expr[0]; \
+            } \
+        t_old = elapsed(&start); \
+        clock_gettime(CLOCK_MONOTONIC, &start); \
+        for( pass = 0; pass < BENCH_PASSES; pass++ ) \
+            for( i = 0; i < BENCH_BUFFER; i++ ) \
+            { \
+                const unsigned char *p = buffer + i; \
+                new_expr; \
+                sink += out[0]; \
+            } \
+        t_new = elapsed(&start); \
+        report(name, t_old, t_new); \
+    } while( 0 )
+
+    BENCH_DECODE("conv_ui32", old_conv_ui32(p), conv_ui32(p));
+    BENCH_DECODE("conv_ui24", old_conv_ui24(p, 0), conv_ui24(p, 0));
+    BENCH_DECODE("conv_ui16", old_conv_ui16(p), conv_ui16(p));
+    BENCH_DECODE("conv_double", (long long)old_conv_double(p), (long long)conv_double(p));
+    BENCH_ENCODE("encode_ui32", old_format_ui32(*p), encode_ui32(out, *p));
+    BENCH_ENCODE("encode_ui24", old_format_ui24(*p), encode_timestamp(out, *p));
+    BENCH_ENCODE("encode_double", old_format_double(*p), encode_double(out, *p));
+
+    free(buffer);
+    return 0;
+}
+
+/*
+ * elapsed()
+ *
+ * Returns the number of seconds since the time "start".
+ */
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * report()
+ *
+ * Print the time per operation taken by the old and new versions of the
+ * codec "name", given the total times "t_old" and "t_new" in seconds.
+ */
+static void report(const char *name, double t_old, double t_new)
+{
+    double ops = (double)BENCH_PASSES * BENCH_BUFFER;
+
+    printf("%-16s %10.3f %10.3f %7.2fx\n", name, t_old * 1e9 / ops, t_new * 1e9 / ops,
+           t_new > 0 ? t_old / t_new : 0);
+    return;
+}
+
+/* The original data_conv.c codecs, unchanged apart from their names */
+
+static NOINLINE double old_conv_double(const unsigned char *ptr)
+{
+   if( IS_BIG_ENDIAN )
+       return *(double *)ptr;
+   else
+   {
+       int i = 0, j = sizeof(double);
+       unsigned char doublebuff[sizeof(double)];
+
+       /* Swap endian-ness */
+       while( --j >= 0 )
+           doublebuff[j] = ptr[i++];
+
+       return *(double *)doublebuff;
+   }
+}
+
+static NOINLINE unsigned int old_conv_ui32(const unsigned char *ptr)
+{
+   if( IS_BIG_ENDIAN )
+       return *(unsigned int *)ptr;
+   else
+   {
+       int i = 0, j = 4;
+       unsigned char intbuff[4];
+
+       /* Swap endian-ness */
+       while( --j >= 0 )
+           intbuff[j] = ptr[i++];
+
+       return *(unsigned int *)intbuff;
+   }
+}
+
+static NOINLINE unsigned int old_conv_ui24(const unsigned char *ptr, unsigned char highbyte)
+{
+   unsigned char intbuff[4];
+   int i = 0, j;
+
+   if( IS_BIG_ENDIAN )
+   {
+       intbuff[0] = highbyte;
+       memcpy(&intbuff[1], ptr, 3);
+   }
+   else
+   {
+       intbuff[3] = highbyte;
+       /* Swap endian-ness */
+       for( j = 2; j >= 0; j-- )
+           intbuff[j] = ptr[i++];
+   }
+
+   return *(unsigned int *)intbuff;
+}
+
+static NOINLINE unsigned short old_conv_ui16(const unsigned char *ptr)
+{
+   if( IS_BIG_ENDIAN )
+       return *(unsigned short *)ptr;
+   else
+   {
+       unsigned char intbuff[2];
+
+       /* Swap endian-ness */
+       intbuff[0] = ptr[1];
+       intbuff[1] = ptr[0];
+
+       return *(unsigned short *)intbuff;
+   }
+}
+
+static NOINLINE unsigned char *old_format_double(double number)
+{
+    static unsigned char outbuff[sizeof(double)];
+    int i, j = 0;
+
+    if( IS_BIG_ENDIAN )
+        memcpy(outbuff, (unsigned char *)&number, sizeof(double));
+    else
+    {
+        for( i = sizeof(double) - 1; i >= 0; i-- )
+            outbuff[j++] = ((unsigned char *) &number)[i];
+    }
+
+    return outbuff;
+}
+
+static NOINLINE unsigned char *old_format_ui32(unsigned int number)
+{
+    static unsigned char outbuff[4];
+    int i, j = 0;
+
+    if( IS_BIG_ENDIAN )
+        memcpy(outbuff, (unsigned char *)&number, 4);
+    else
+    {
+        for( i = 3; i >= 0; i-- )
+            outbuff[j++] = ((unsigned char *) &number)[i];
+    }
+
+    return outbuff;
+}
+
+static NOINLINE unsigned char *old_format_ui24(unsigned int number)
+{
+    static unsigned char outbuff[4];
+    int i, j = 0;
+
+    if( IS_BIG_ENDIAN )
+    {
+        outbuff[3] = ((unsigned char *)&number)[0];
+        for( i = 1; i < 4; i++ )
+            outbuff[j++] = ((unsigned char *)&number)[i];
+    }
+    else
+    {
+        outbuff[3] = ((unsigned char *) &number)[3];
+        for( i = 2; i >= 0; i-- )
+            outbuff[j++] = ((unsigned char *) &number)[i];
+    }
+
+    return outbuff;
+}
@@ -1,11 +1,217 @@
-/* data_conv.c */
-double conv_double(const unsigned char *);
-unsigned int conv_ui32(const unsigned char *);
-unsigned int conv_ui24(const unsigned char *, unsigned char);
-unsigned short conv_ui16(const unsigned char *);
-short conv_si16(const unsigned char *);
+/* data_conv.h */
+#ifndef DATA_CONV_H
+#define DATA_CONV_H
 
+/*
+ * The conversion functions below are called several times for every tag, so
+ * they are defined inline here and the byte order of the host is selected at
+ * compile time. Unaligned loads are done through memcpy(), which compilers
+ * reduce to a single load; on little-endian hosts this is followed by a
+ * byte-swap instruction.
+ */
+#include <string.h> /* for memcpy() */
+#include <stdint.h>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define FLV_HOST_BIG_ENDIAN
+#elif !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#define FLV_HOST_UNKNOWN_ENDIAN
+#endif
+
+#if defined(FLV_HOST_BIG_ENDIAN)
+#define FLV_BE16(x) (x)
+#define FLV_BE32(x) (x)
+#define FLV_BE64(x) (x)
+#elif defined(__GNUC__) && !defined(FLV_HOST_UNKNOWN_ENDIAN)
+#define FLV_BE16(x) __builtin_bswap16(x)
+#define FLV_BE32(x) __builtin_bswap32(x)
+#define FLV_BE64(x) __builtin_bswap64(x)
+#endif
+
+#ifdef FLV_BE32
+
+static inline uint16_t load_be16(const unsigned char *ptr)
+{
+    uint16_t v;
+    memcpy(&v, ptr, 2);
+    return FLV_BE16(v);
+}
+
+static inline uint32_t load_be32(const unsigned char *ptr)
+{
+    uint32_t v;
+    memcpy(&v, ptr, 4);
+    return FLV_BE32(v);
+}
+
+static inline uint64_t load_be64(const unsigned char *ptr)
+{
+    uint64_t v;
+    memcpy(&v, ptr, 8);
+    return FLV_BE64(v);
+}
+
+static inline void store_be16(unsigned char *ptr, uint16_t v)
+{
+    v = FLV_BE16(v);
+    memcpy(ptr, &v, 2);
+}
+
+static inline void store_be32(unsigned char *ptr, uint32_t v)
+{
+    v = FLV_BE32(v);
+    memcpy(ptr, &v, 4);
+}
+
+static inline void store_be64(unsigned char *ptr, uint64_t v)
+{
+    v = FLV_BE64(v);
+    memcpy(ptr, &v, 8);
+}
+
+#else /* Byte order unknown, or no byte-swap builtins: portable shifts */
+
+static inline uint16_t load_be16(const unsigned char *ptr)
+{
+    return (uint16_t)(ptr[0] << 8 | ptr[1]);
+}
+
+static inline uint32_t load_be32(const unsigned char *ptr)
+{
+    return (uint32_t)ptr[0] << 24 | (uint32_t)ptr[1] << 16 | (uint32_t)ptr[2] << 8 | ptr[3];
+}
+
+static inline uint64_t load_be64(const unsigned char *ptr)
+{
+    return (uint64_t)load_be32(ptr) << 32 | load_be32(ptr + 4);
+}
+
+static inline void store_be16(unsigned char *ptr, uint16_t v)
+{
+    ptr[0] = v >> 8;
+    ptr[1] = v;
+}
+
+static inline void store_be32(unsigned char *ptr, uint32_t v)
+{
+    ptr[0] = v >> 24;
+    ptr[1] = v >> 16;
+    ptr[2] = v >> 8;
+    ptr[3] = v;
+}
+
+static inline void store_be64(unsigned char *ptr, uint64_t v)
+{
+    store_be32(ptr, (uint32_t)(v >> 32));
+    store_be32(ptr + 4, (uint32_t)v);
+}
+
+#endif
+
+/*
+ * conv_double()
+ * 
+ * Converts the 8-byte big-endian IEEE 754 number starting at memory location
+ * "ptr" (the DOUBLE type in FLV script data) to a C double.
+ */
+static inline double conv_double(const unsigned char *ptr)
+{
+    uint64_t bits = load_be64(ptr);
+    double number;
+
+    memcpy(&number, &bits, sizeof(double));
+    return number;
+}
+
+/*
+ * conv_ui32()
+ * 
+ * Converts the number contained in the 4 bytes starting at memory location
+ * "ptr" from the UI32 byte-stream format used in FLV files (i.e. big-endian
+ * order) to a C unsigned integer type.
+ */
+static inline unsigned int conv_ui32(const unsigned char *ptr)
+{
+    return load_be32(ptr);
+}
+
+/*
+ * conv_ui24()
+ * 
+ * Converts the number contained in the 3 bytes starting at memory location
+ * "ptr" from the UI24 byte-stream format used in FLV files to a C unsigned 
+ * integer type, including "highbyte" as the high byte of a 4-byte unsigned 
+ * integer - thus allowing the function to also be used to convert FLV 
+ * timestamp values stored in UI24 + high byte format. For other uses 
+ * "highbyte" should be set to 0.
+ * Only the 3 bytes are read, so this is safe at the very end of a buffer.
+ */
+static inline unsigned int conv_ui24(const unsigned char *ptr, unsigned char highbyte)
+{
+    return (unsigned int)highbyte << 24 | (unsigned int)load_be16(ptr) << 8 | ptr[2];
+}
+
+static inline unsigned short conv_ui16(const unsigned char *ptr)
+{
+    return load_be16(ptr);
+}
+
+static inline short conv_si16(const unsigned char *ptr)
+{
+    return (short)load_be16(ptr);
+}
+
+/*
+ * encode_double(), encode_ui32(), encode_ui24(), encode_timestamp(),
+ * encode_ui16()
+ * 
+ * Write "number" in the corresponding FLV byte-stream format to the memory
+ * starting at "dst". encode_timestamp() writes the 4-byte UI24 + high byte
+ * form used for tag timestamps.
+ * 
+ * Return a pointer to the byte following the encoded number, so that several
+ * fields can be serialised into one buffer in a single pass.
+ */
+static inline unsigned char *encode_double(unsigned char *dst, double number)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &number, sizeof(double));
+    store_be64(dst, bits);
+    return dst + 8;
+}
+
+static inline unsigned char *encode_ui32(unsigned char *dst, unsigned int number)
+{
+    store_be32(dst, number);
+    return dst + 4;
+}
+
+static inline unsigned char *encode_ui24(unsigned char *dst, unsigned int number)
+{
+    store_be16(dst, (uint16_t)(number >> 8));
+    dst[2] = (unsigned char)number;
+    return dst + 3;
+}
+
+static inline unsigned char *encode_timestamp(unsigned char *dst, unsigned int timestamp)
+{
+    dst = encode_ui24(dst, timestamp);
+    *dst = (unsigned char)(timestamp >> 24);
+    return dst + 1;
+}
+
+static inline unsigned char *encode_ui16(unsigned char *dst, unsigned short number)
+{
+    store_be16(dst, number);
+    return dst + 2;
+}
+
+/* data_conv.c - these return statically-allocated buffers and so are not
+ * reentrant; the encode_*() functions above are preferred */
 unsigned char *format_double(double);
 unsigned char *format_ui32(unsigned int);
 unsigned char *format_ui24(unsigned int);
 unsigned char *format_ui16(unsigned short);
+
+#endif /* DATA_CONV_H */
@@ -0,0 +1,257 @@
+/* 
+    flvaudit.c
+    Gathering statistics for many FLV files in parallel, for auditing
+    archives of recordings.
+    by Paul Kelly
+    Copyright (C) 2007-09 Radiomonitor Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "flvscan.h"
+
+/* Maximum length of a path read from a file list */
+#define MAX_NAME_LEN 1024
+
+/* Work shared between the audit threads */
+struct audit_queue
+{
+    struct FLVaudit_job *jobs;
+    size_t *order; /* job numbers, largest file first */
+    size_t count, next;
+    int mode;
+    pthread_mutex_t lock;
+};
+
+static struct FLVaudit_job *add_job(struct FLVaudit_job *, size_t *, const char *, unsigned long long);
+static void *audit_thread(void *);
+static int compare_size(const void *, const void *);
+
+static const struct FLVaudit_job *sort_jobs; /* for compare_size() */
+
+/*
+ * audit_add_path()
+ * 
+ * Add the file "path" to the array of "*count" jobs at "jobs", or if "path"
+ * is a directory, all files ending in ".flv" in it and its subdirectories.
+ * 
+ * Returns the (possibly moved) array of jobs.
+ */
+struct FLVaudit_job *audit_add_path(struct FLVaudit_job *jobs, size_t *count, const char *path)
+{
+    struct stat s;
+    DIR *dir;
+    struct dirent *entry;
+
+    if( stat(path, &s) != 0 )
+        return add_job(jobs, count, path, 0); /* The error is reported when it's read */
+    if( !S_ISDIR(s.st_mode) )
+        return add_job(jobs, count, path, s.st_size);
+
+    if( !(dir = opendir(path)) )
+    {
+        fprintf(stderr, "Error opening directory %s: %s\n", path, strerror(errno));
+        return jobs;
+    }
+    while( (entry = readdir(dir)) )
+    {
+        size_t len = strlen(entry->d_name);
+        char *child;
+
+        if( strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 )
+            continue;
+        child = malloc(strlen(path) + len + 2);
+        sprintf(child, "%s/%s", path, entry->d_name);
+        /* Symbolic links to directories aren't followed, as they may
+         * lead round in a loop; links to files are */
+        if( lstat(child, &s) == 0 )
+        {
+            if( S_ISDIR(s.st_mode) )
+                jobs = audit_add_path(jobs, count, child);
+            else if( len > 4 && strcasecmp(entry->d_name + len - 4, ".flv") == 0 &&
+                     (!S_ISLNK(s.st_mode) || (stat(child, &s) == 0 && !S_ISDIR(s.st_mode))) )
+                jobs = add_job(jobs, count, child, s.st_size);
+        }
+        free(child);
+    }
+    closedir(dir);
+
+    return jobs;
+}
+
+/*
+ * audit_add_list()
+ * 
+ * Add each file or directory named on a line of the stream "list" to the
+ * array of "*count" jobs at "jobs", as audit_add_path() does.
+ * 
+ * Returns the (possibly moved) array of jobs.
+ */
+struct FLVaudit_job *audit_add_list(struct FLVaudit_job *jobs, size_t *count, FILE *list)
+{
+    char buffer[MAX_NAME_LEN];
+
+    while( fgets(buffer, sizeof(buffer), list) )
+    {
+        char *newline = strchr(buffer, '\n');
+        if(newline) /* Remove newline character */
+            *newline = '\0';
+        if( buffer[0] != '\0' )
+            jobs = audit_add_path(jobs, count, buffer);
+    }
+
+    return jobs;
+}
+
+/*
+ * audit_run()
+ * 
+ * Gather the statistics (if "mode" includes AUDIT_STATS) and check the
+ * structure (if it includes AUDIT_CHECK) of each of the "count" files in
+ * "jobs", using "threads" threads. Files are handed out largest first, so that a big file
+ * picked up near the end doesn't leave one thread working long after the
+ * others have finished.
+ */
+void audit_run(struct FLVaudit_job *jobs, size_t count, int threads, int mode)
+{
+    struct audit_queue queue;
+    pthread_t *tids;
+    size_t i;
+    int t, err;
+
+    queue.jobs = jobs;
+    queue.count = count;
+    queue.next = 0;
+    queue.mode = mode;
+    queue.order = malloc(count * sizeof(size_t));
+    for( i = 0; i < count; i++ )
+        queue.order[i] = i;
+    sort_jobs = jobs;
+    qsort(queue.order, count, sizeof(size_t), compare_size);
+    pthread_mutex_init(&queue.lock, NULL);
+
+    if( threads < 1 )
+        threads = 1;
+    if( (size_t)threads > count )
+        threads = count;
+    tids = malloc(threads * sizeof(pthread_t));
+    for( t = 0; t < threads; t++ )
+        if( (err = pthread_create(&tids[t], NULL, audit_thread, &queue)) != 0 )
+        {
+            fprintf(stderr, "Error creating thread: %s\n", strerror(err));
+            break;
+        }
+    if( t == 0 )
+        audit_thread(&queue); /* Do it all ourselves */
+    while( t-- > 0 )
+        pthread_join(tids[t], NULL);
+
+    pthread_mutex_destroy(&queue.lock);
+    free(tids);
+    free(queue.order);
+
+    return;
+}
+
+/*
+ * audit_thread()
+ * 
+ * Take jobs from the queue "arg" and process each file until there are none
+ * left.
+ */
+static void *audit_thread(void *arg)
+{
+    struct audit_queue *queue = arg;
+
+    while(1)
+    {
+        struct FLVaudit_job *job;
+        struct FLVmap map;
+
+        pthread_mutex_lock(&queue->lock);
+        job = queue->next < queue->count ? &queue->jobs[queue->order[queue->next++]] : NULL;
+        pthread_mutex_unlock(&queue->lock);
+        if( !job )
+            break;
+
+        if( map_file(job->filename, &map) != 0 )
+        {
+            job->error = errno;
+            continue;
+        }
+        if( queue->mode & AUDIT_STATS )
+            stats_file(&job->stats, &map);
+        if( queue->mode & AUDIT_CHECK )
+            check_file(&job->check, &map);
+        job->size = map.length;
+        unmap_file(&map);
+    }
+
+    return NULL;
+}
+
+/*
+ * add_job()
+ * 
+ * Append a job for the file "filename" of "size" bytes to the array of
+ * "*count" jobs at "jobs".
+ * 
+ * Returns the (possibly moved) array of jobs.
+ */
+static struct FLVaudit_job *add_job(struct FLVaudit_job *jobs, size_t *count, const char *filename,
+                                    unsigned long long size)
+{
+    /* Grow in powers of two */
+    if( (*count & (*count - 1)) == 0 )
+        jobs = realloc(jobs, (*count ? 2 * *count : 1) * sizeof(struct FLVaudit_job));
+    if( !jobs )
+    {
+        fprintf(stderr, "ERROR: Out of memory adding %s\n", filename);
+        exit(1);
+    }
+
+    memset(&jobs[*count], 0, sizeof(struct FLVaudit_job));
+    jobs[*count].filename = strdup(filename);
+    jobs[*count].size = size;
+    stats_init(&jobs[*count].stats);
+    (*count)++;
+
+    return jobs;
+}
+
+/*
+ * compare_size()
+ * 
+ * qsort() comparison function ordering job numbers by decreasing file size.
+ */
+static int compare_size(const void *a, const void *b)
+{
+    unsigned long long size_a = sort_jobs[*(const size_t *)a].size;
+    unsigned long long size_b = sort_jobs[*(const size_t *)b].size;
+
+    return size_a < size_b ? 1 : size_a > size_b ? -1 : 0;
+}
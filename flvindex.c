@@ -0,0 +1,381 @@
+/* 
+    flvindex.c
+    Compact in-memory index of the tags in an FLV file, with lookups by
+    timestamp for seeking to edit points.
+    by Paul Kelly
+    Copyright (C) 2007-09 Radiomonitor Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "data_conv.h"
+#include "flvscan.h"
+
+static int index_add(struct FLVindex *, const struct FLVscan *, size_t, unsigned char, size_t);
+static size_t start_block(const struct FLVindex *, unsigned int);
+
+/*
+ * index_build()
+ * 
+ * Build an index of all the complete tags in the mapped file "map", using
+ * the bulk scanner to decode the tag headers and peeking at the first two
+ * payload bytes of video tags to find keyframes and AVC sequence headers.
+ * If "max_bytes" is non-zero, building is abandoned as soon as the index
+ * would need more memory than that.
+ * 
+ * Returns 0 on success, or -1 if the memory limit was reached (in which
+ * case the index is left empty).
+ */
+int index_build(struct FLVindex *index, const struct FLVmap *map, size_t max_bytes)
+{
+    struct FLVscan scan;
+    size_t offset = scan_header(map->base, map->length);
+
+    memset(index, 0, sizeof(struct FLVindex));
+    memset(&scan, 0, sizeof(scan));
+    index->monotonic = 1;
+
+    do {
+        size_t i;
+
+        scan_reset(&scan);
+        offset = scan_tags(map->base, map->length, offset, &scan, SCAN_BATCH);
+
+        for( i = 0; i < scan.count; i++ )
+        {
+            const unsigned char *payload = map->base + scan.offsets[i] + 11;
+            unsigned char flags = 0;
+
+            switch( scan.types[i] )
+            {
+                case 8:
+                    flags = TAG_AUDIO | TAG_KEYFRAME; /* All audio packets are keyframes */
+                    break;
+                case 9:
+                    flags = TAG_VIDEO;
+                    if( scan.sizes[i] >= 1 && (payload[0] & 0xf0) >> 4 == 1 )
+                        flags |= TAG_KEYFRAME;
+                    if( scan.sizes[i] >= 2 && (payload[0] & 0x0f) == 7 && payload[1] == 0 )
+                        flags |= TAG_AVC_SEQHDR;
+                    break;
+                case 18:
+                    flags = TAG_SCRIPT;
+                    break;
+            }
+            if( index_add(index, &scan, i, flags, max_bytes) != 0 )
+            {
+                scan_free(&scan);
+                index_free(index);
+                return -1;
+            }
+        }
+    } while( scan.count == SCAN_BATCH );
+
+    scan_free(&scan);
+    return 0;
+}
+
+/*
+ * index_free()
+ * 
+ * Free the arrays held by "index".
+ */
+void index_free(struct FLVindex *index)
+{
+    free(index->block_timestamp);
+    free(index->block_offset);
+    free(index->block_first);
+    free(index->ts_delta);
+    free(index->offset_delta);
+    free(index->sizes);
+    free(index->flags);
+    memset(index, 0, sizeof(struct FLVindex));
+
+    return;
+}
+
+/*
+ * index_memory()
+ * 
+ * Returns the number of bytes allocated for "index".
+ */
+size_t index_memory(const struct FLVindex *index)
+{
+    return index->alloc * (sizeof(int16_t) + sizeof(uint32_t) + sizeof(unsigned int) + 1) +
+           index->block_alloc * (sizeof(unsigned int) + sizeof(uint64_t) + sizeof(size_t));
+}
+
+/*
+ * index_timestamp()
+ * 
+ * Returns the timestamp of tag number "i" in "index".
+ */
+unsigned int index_timestamp(const struct FLVindex *index, size_t i)
+{
+    size_t lo = 0, hi = index->blocks;
+
+    /* Find the block containing the tag */
+    while( hi - lo > 1 )
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if( index->block_first[mid] <= i )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return index->block_timestamp[lo] + index->ts_delta[i];
+}
+
+/*
+ * index_offset()
+ * 
+ * Returns the byte offset within the file of the header of tag number "i" in
+ * "index".
+ */
+uint64_t index_offset(const struct FLVindex *index, size_t i)
+{
+    size_t lo = 0, hi = index->blocks;
+
+    while( hi - lo > 1 )
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if( index->block_first[mid] <= i )
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return index->block_offset[lo] + index->offset_delta[i];
+}
+
+/*
+ * index_first_from()
+ * 
+ * Find the first tag in file order with a timestamp of at least "timestamp"
+ * that has all of the flags in "flags" set (e.g. TAG_VIDEO | TAG_KEYFRAME for
+ * the first video keyframe at or after a point; 0 for any tag).
+ * 
+ * Returns the tag number, or -1 if there is no such tag.
+ */
+long index_first_from(const struct FLVindex *index, unsigned int timestamp, unsigned char flags)
+{
+    size_t b;
+
+    for( b = start_block(index, timestamp); b < index->blocks; b++ )
+    {
+        size_t i = index->block_first[b];
+        size_t end = b + 1 < index->blocks ? index->block_first[b + 1] : index->count;
+        long base = index->block_timestamp[b];
+
+        for( ; i < end; i++ )
+            if( base + index->ts_delta[i] >= (long)timestamp &&
+                (index->flags[i] & flags) == flags )
+                return i;
+    }
+
+    return -1;
+}
+
+/*
+ * index_last_before()
+ * 
+ * Find the last tag in file order with a timestamp less than "timestamp"
+ * that has all of the flags in "flags" set.
+ * 
+ * Returns the tag number, or -1 if there is no such tag.
+ */
+long index_last_before(const struct FLVindex *index, unsigned int timestamp, unsigned char flags)
+{
+    size_t b = index->blocks;
+
+    if( index->monotonic )
+    {
+        /* Skip the blocks at the end whose tags must all be later */
+        size_t lo = 0, hi = index->blocks;
+
+        while( lo < hi )
+        {
+            size_t mid = (lo + hi) / 2;
+
+            if( (long)index->block_timestamp[mid] + index->min_delta >= (long)timestamp )
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        b = lo;
+    }
+
+    while( b-- > 0 )
+    {
+        size_t i = b + 1 < index->blocks ? index->block_first[b + 1] : index->count;
+        long base = index->block_timestamp[b];
+
+        while( i-- > index->block_first[b] )
+            if( base + index->ts_delta[i] < (long)timestamp &&
+                (index->flags[i] & flags) == flags )
+                return i;
+    }
+
+    return -1;
+}
+
+/*
+ * index_bytes()
+ * 
+ * Returns the total number of bytes (headers, payloads and back-pointers)
+ * taken up by the tags with timestamps from "start" up to but not including
+ * "end".
+ */
+uint64_t index_bytes(const struct FLVindex *index, unsigned int start, unsigned int end)
+{
+    uint64_t total = 0;
+    size_t b;
+
+    for( b = start_block(index, start); b < index->blocks; b++ )
+    {
+        size_t i = index->block_first[b];
+        size_t last = b + 1 < index->blocks ? index->block_first[b + 1] : index->count;
+        long base = index->block_timestamp[b];
+
+        if( index->monotonic && base + index->min_delta >= (long)end )
+            break; /* This and all later blocks are past the end */
+
+        for( ; i < last; i++ )
+        {
+            long ts = base + index->ts_delta[i];
+
+            if( ts >= (long)start && ts < (long)end )
+                total += 11 + index->sizes[i] + 4;
+        }
+    }
+
+    return total;
+}
+
+/*
+ * start_block()
+ * 
+ * Returns the first block that can contain a tag with a timestamp of at least
+ * "timestamp"; all tags in earlier blocks are known to be before it.
+ */
+static size_t start_block(const struct FLVindex *index, unsigned int timestamp)
+{
+    size_t lo = 0, hi = index->blocks;
+
+    if( !index->monotonic )
+        return 0;
+
+    /* Find the first block whose tags might reach the timestamp; then
+     * all blocks before it are entirely earlier */
+    while( lo < hi )
+    {
+        size_t mid = (lo + hi) / 2;
+
+        if( (long)index->block_timestamp[mid] + index->max_delta < (long)timestamp )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * index_add()
+ * 
+ * Append tag number "i" of "scan" to "index" with flags "flags", starting a
+ * new block if the current one is full or the tag's timestamp or offset
+ * can't be expressed relative to it.
+ * 
+ * Returns 0 on success, or -1 if the index would exceed "max_bytes" bytes
+ * (if non-zero).
+ */
+static int index_add(struct FLVindex *index, const struct FLVscan *scan, size_t i,
+                     unsigned char flags, size_t max_bytes)
+{
+    size_t n = index->count;
+    size_t b = index->blocks;
+    long delta = 0;
+
+    if( b > 0 )
+    {
+        delta = (long)scan->timestamps[i] - (long)index->block_timestamp[b - 1];
+        if( n - index->block_first[b - 1] >= INDEX_BLOCK || delta < INT16_MIN || delta > INT16_MAX ||
+            scan->offsets[i] - index->block_offset[b - 1] > UINT32_MAX )
+            b++; /* Start a new block */
+    }
+    else
+        b++;
+
+    if( n >= index->alloc || b > index->block_alloc )
+    {
+        size_t alloc = n >= index->alloc ? (index->alloc ? 2 * index->alloc : 1024) : index->alloc;
+        size_t block_alloc = b > index->block_alloc ? (index->block_alloc ? 2 * index->block_alloc : 64)
+                                                    : index->block_alloc;
+        size_t old_alloc = index->alloc, old_block_alloc = index->block_alloc;
+
+        index->alloc = alloc;
+        index->block_alloc = block_alloc;
+        if( max_bytes && index_memory(index) > max_bytes )
+        {
+            index->alloc = old_alloc;
+            index->block_alloc = old_block_alloc;
+            return -1;
+        }
+        index->ts_delta = realloc(index->ts_delta, alloc * sizeof(int16_t));
+        index->offset_delta = realloc(index->offset_delta, alloc * sizeof(uint32_t));
+        index->sizes = realloc(index->sizes, alloc * sizeof(unsigned int));
+        index->flags = realloc(index->flags, alloc);
+        index->block_timestamp = realloc(index->block_timestamp, block_alloc * sizeof(unsigned int));
+        index->block_offset = realloc(index->block_offset, block_alloc * sizeof(uint64_t));
+        index->block_first = realloc(index->block_first, block_alloc * sizeof(size_t));
+        if( !index->ts_delta || !index->offset_delta || !index->sizes || !index->flags ||
+            !index->block_timestamp || !index->block_offset || !index->block_first )
+        {
+            fprintf(stderr, "ERROR: Out of memory building tag index\n");
+            exit(1);
+        }
+    }
+
+    if( b > index->blocks )
+    {
+        if( b > 1 && scan->timestamps[i] < index->block_timestamp[b - 2] )
+            index->monotonic = 0;
+        index->block_timestamp[b - 1] = scan->timestamps[i];
+        index->block_offset[b - 1] = scan->offsets[i];
+        index->block_first[b - 1] = n;
+        index->blocks = b;
+        delta = 0;
+    }
+
+    index->ts_delta[n] = (int16_t)delta;
+    index->offset_delta[n] = (uint32_t)(scan->offsets[i] - index->block_offset[b - 1]);
+    index->sizes[n] = scan->sizes[i];
+    index->flags[n] = flags;
+    if( delta < index->min_delta )
+        index->min_delta = delta;
+    if( delta > index->max_delta )
+        index->max_delta = delta;
+    index->count++;
+
+    return 0;
+}
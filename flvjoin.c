@@ -18,42 +18,140 @@
     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 
+#define _GNU_SOURCE /* For O_TMPFILE */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
+#include <signal.h>
+#include <time.h>
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "flvjoin.h"
-
-/* Maximum length for input and output filenames (including full path) */
-#define MAX_NAME_LEN 1024
+#include "flvscan.h"
+
+/* Size of the chunks used when copying payloads that are not held in memory */
+#define COPY_CHUNK 65536
+
+/* Out-point (in seconds) used when none is given */
+#define OPEN_MARK_OUT 99999
+/* Number of tags examined to decide whether a file is audio-only */
+#define AUDIO_DETECT_TAGS 100
+/* How often a followed input file is checked for new data */
+#define FOLLOW_POLL_MS 100
+/* How far (in ms) past the last out-point a source file is read when
+ * cutting clips, as audio and video tags needn't be in timestamp order */
+#define CLIP_SLACK_MS 5000
+/* Amount of input read or output written (in bytes) between drops from
+ * the page cache in cache-neutral mode */
+#define CACHE_WINDOW (8L * 1024 * 1024)
+/* Memory (in bytes) for the io_uring output buffers shared by all output
+ * files, and the least worth using when the memory budget is tight */
+#define URING_MEMORY (8L * 1024 * 1024)
+#define URING_MIN_MEMORY (64L * 1024)
+/* Output written (in bytes) between checkpoints */
+#define CHECKPOINT_BYTES (64L * 1024 * 1024)
 
 int quiet;
 static int no_meta;
 static int frame_interval = 100;
-
-static char filepath[MAX_NAME_LEN];
-static FILE *outfile = NULL;
+static int audio_bitrate = 32000;
+/* Output has audio only (forced with -a, or because the first input file
+ * has no video); joins are then synchronised on the audio stream */
+static int audio_only, force_audio_only;
+/* Seconds to wait for the last input file to grow before finishing
+ * (-1 = don't follow it), and set by a signal to finish early */
+static int follow_timeout = -1;
+static volatile sig_atomic_t stop_following;
 
 static struct FLVpacket seq_header_pkt;
-
-static unsigned int last_video_timestamp;
-static long last_audio_timestamp = -1;
-static unsigned int last_packet_size;
-
-static void write_flv_header(void);
-
-static void append_file(const char *, unsigned int, unsigned int);
-static void buffer_packet(struct FLVpacket *, long, char);
-static void write_packet(struct FLVpacket *, long);
-
-static void open_output(const char *);
-static void write_output(unsigned char *, size_t);
-static void close_output(void);
+/* No input metadata has been taken yet */
+static char metadata_extracted;
+/* Append to an existing output file (-u) */
+static int update_output;
+/* Length in ms of the chunks the output is split into (0 = don't split),
+ * the printf-style pattern naming them, and the AAC sequence header that
+ * starts the audio of each chunk */
+static long split_interval;
+static char split_pattern[MAX_NAME_LEN];
+static struct FLVpacket aac_header_pkt;
+/* File the progress of the join is saved to (-k), the amount of output at
+ * the last save, and the number of the input list line being read */
+static char *checkpoint_path;
+static unsigned long long checkpoint_size;
+static unsigned long input_number;
+/* Resume from the checkpoint (-r): where to carry on reading */
+static int resume;
+static struct FLVcheckpoint resume_point;
+/* Publish each output file only once it is complete (-t), and flush output
+ * files to disk before closing them (-y) */
+static int atomic_output, sync_output;
+/* Write output files through io_uring where the kernel allows it (-i) */
+static int use_uring;
+/* Drop input and output from the page cache once done with (-p) */
+static int cache_neutral;
+
+/* Memory budget for tag payloads in bytes (0 = unlimited) and the amount
+ * currently accounted against it */
+static size_t mem_budget;
+static size_t mem_used;
+/* Temporary file holding buffered payloads that didn't fit in the budget,
+ * and how much of it has been dropped from the page cache (-p) */
+static FILE *spill_file;
+static long spill_dropped;
+
+static void init_writer(struct FLVwriter *);
+static void write_flv_header(struct FLVwriter *);
+
+static void append_file(struct FLVwriter *, const char *, unsigned int, unsigned int, int);
+static void buffer_packet(struct FLVwriter *, struct FLVpacket *, long, char);
+static void write_packet(struct FLVwriter *, struct FLVpacket *, long);
+static void write_tag(struct FLVwriter *, struct FLVpacket *, long);
+
+static int mem_reserve(size_t);
+static void mem_release(size_t);
+static void spill_payload(struct FLVpacket *, FILE *);
+static void reset_spill(void);
+static void copy_payload(struct FLVwriter *, struct FLVpacket *);
+static void skip_input(FILE *, size_t);
+static size_t parse_size(const char *);
+
+static void recover_output(struct FLVwriter *);
+static int walk_back(struct FLVwriter *, const struct FLVmap *, size_t, size_t);
+static int detect_audio_only(const struct FLVmap *, size_t);
+static int wait_for_input(struct FLVwriter *, FILE *, size_t, size_t *);
+static void handle_stop(int);
+static long audio_frame_interval(struct FLVwriter *);
+static void start_output(struct FLVwriter *);
+static void write_metadata_packet(struct FLVwriter *);
+static void open_output(struct FLVwriter *, const char *);
+static void open_temporary(struct FLVwriter *);
+static const char *output_dir(char *, const char *);
+static void publish_output(struct FLVwriter *);
+static void write_output(struct FLVwriter *, unsigned char *, size_t);
+static struct FLVuring *start_uring(struct FLVwriter *);
+static void flush_output(struct FLVwriter *);
+static void settle_output(struct FLVwriter *);
+static size_t drop_input_cache(FILE *, const struct FLVmap *, size_t, size_t);
+static void drop_output_cache(struct FLVwriter *, int);
+static void close_output(struct FLVwriter *);
+static void finish_output(struct FLVwriter *);
+static void extract_clips(const char *);
+static int is_split_point(const struct FLVpacket *);
+static void next_chunk(struct FLVwriter *, long);
+static void keep_aac_header(const struct FLVpacket *);
+static void chunk_name(struct FLVwriter *);
+static int check_pattern(const char *);
+static void write_checkpoint(struct FLVwriter *, size_t, long);
+static void resume_output(struct FLVwriter *);
+static void prescan_file(const char *);
 
 /*
  * main()
@@ -63,22 +161,72 @@ static void close_output(void);
  * FLV header to the file, close and exit.
  * Otherwise open output file for appending, read filenames from stdin one at a
  * time and process each one with append_file(). Finally close output file.
+ * With -c, hand over to extract_clips() instead. With -s, the output
+ * filename is a pattern and the output is written in chunks.
  */
 int main (int argc, char ** argv)
 {
     char buffer[2*MAX_NAME_LEN];
-    int audio_bitrate = 32000;
+    struct FLVwriter output;
+    char source[MAX_NAME_LEN] = "";
     int opt;
 
-    filepath[0] = '\0';
+    init_writer(&output);
 
     /* Parse command-line options */
-    while ( (opt = getopt(argc, argv, "o:f:b:ndqh")) != -1 ) 
+    while ( (opt = getopt(argc, argv, "o:c:s:k:f:b:m:w:rtyipuandqh")) != -1 ) 
     {
         switch (opt)
         {
             case 'o':
-                strncpy(filepath, optarg, sizeof(filepath));
+                if( strlen(optarg) >= MAX_NAME_LEN )
+                {
+                    fprintf(stderr, "ERROR: Output filename too long: %s\n", optarg);
+                    exit(1);
+                }
+                if( strlen(output.path) == 0 )
+                    strcpy(output.path, optarg);
+                else
+                {
+                    /* Another destination for the same output */
+                    struct FLVwriter *t = malloc(sizeof(struct FLVwriter)), **end;
+
+                    init_writer(t);
+                    strcpy(t->path, optarg);
+                    for( end = &output.tee; *end; end = &(*end)->tee )
+                        ;
+                    *end = t;
+                }
+                break;
+            case 'c':
+                if( strlen(optarg) >= MAX_NAME_LEN )
+                {
+                    fprintf(stderr, "ERROR: Source filename too long: %s\n", optarg);
+                    exit(1);
+                }
+                strcpy(source, optarg);
+                break;
+            case 's':
+                split_interval = (long)(0.5 + atof(optarg) * 1000);
+                break;
+            case 'k':
+                checkpoint_path = optarg;
+                break;
+            case 'r':
+                resume = 1;
+                break;
+            case 't':
+                atomic_output = 1;
+                break;
+            case 'y':
+                sync_output = 1;
+                break;
+            case 'i':
+                use_uring = 1;
+                break;
+            case 'p':
+                cache_neutral = 1;
+                map_readahead = 0;
                 break;
             case 'f':
                 frame_interval = (int)(0.5 + 1000 / atof(optarg));
@@ -86,6 +234,18 @@ int main (int argc, char ** argv)
             case 'b':
                 audio_bitrate = atoi(optarg);
                 break;
+            case 'm':
+                mem_budget = parse_size(optarg);
+                break;
+            case 'w':
+                follow_timeout = atoi(optarg);
+                break;
+            case 'u':
+                update_output = 1;
+                break;
+            case 'a':
+                force_audio_only = audio_only = 1;
+                break;
             case 'n':  
                 no_meta = 1;
                 break;
@@ -98,11 +258,27 @@ int main (int argc, char ** argv)
             default:
                 fprintf(stderr,"%s v%s\n", PROG_NAME, PROG_VERSION);
                 fprintf(stderr,"\nSynopsis: Reads a list of FLV files (with optional in-point and out-point)\n");
-                fprintf(stderr,"from standard input and joins them together into one larger FLV file.\n\n");
-                fprintf(stderr,"Usage: %s -o <filename> [-f <framerate>] [-b <bitrate>] [-n] [-q] [-h]\n\n", PROG_NAME);
-                fprintf(stderr,"   -o <filename>   Output File (- for stdout)\n");
+                fprintf(stderr,"from standard input and joins them together into one larger FLV file.\n");
+                fprintf(stderr,"With -c, reads a list of clips (in-point, out-point and output filename)\n");
+                fprintf(stderr,"instead and cuts them all from one source file in a single pass.\n\n");
+                fprintf(stderr,"Usage: %s -o <filename> [-s <seconds>] [-k <file> [-r]] [-t] [-y] [-i] [-p] [-f <framerate>] [-b <bitrate>] [-m <bytes>] [-w <seconds>] [-u] [-a] [-n] [-q] [-h]\n", PROG_NAME);
+                fprintf(stderr,"       %s -c <source> [-t] [-y] [-i] [-p] [-f <framerate>] [-b <bitrate>] [-a] [-n] [-q]\n\n", PROG_NAME);
+                fprintf(stderr,"   -o <filename>   Output File (- for stdout); may be given several times\n");
+                fprintf(stderr,"   -c <source>     Cut the clips listed on standard input from this file\n");
+                fprintf(stderr,"   -s <seconds>    Split the output into chunks of this length starting on keyframes;\n");
+                fprintf(stderr,"                   the output filename then needs a %%d for the chunk number\n");
+                fprintf(stderr,"   -k <file>       Save the progress of the join to this file every so often\n");
+                fprintf(stderr,"   -r              Resume an interrupted join from the progress saved with -k\n");
+                fprintf(stderr,"   -t              Atomic output: only give output files their names once complete\n");
+                fprintf(stderr,"   -y              Flush output files to disk before closing them\n");
+                fprintf(stderr,"   -i              Write output files with io_uring where the system supports it\n");
+                fprintf(stderr,"   -p              Cache-neutral: drop input and output from the page cache when done\n");
                 fprintf(stderr,"   -f <framerate>  Video frame rate in frames per second (default %.2f)\n", 1000.0 / frame_interval);
                 fprintf(stderr,"   -b <bitrate>    Audio bitrate in bits per second (default %d)\n", audio_bitrate);
+                fprintf(stderr,"   -m <bytes>      Memory budget for tag data, suffix k, M or G allowed (default unlimited)\n");
+                fprintf(stderr,"   -w <seconds>    Follow the last input file as it grows, until idle this long\n");
+                fprintf(stderr,"   -u              Append to the output file if it already exists\n");
+                fprintf(stderr,"   -a              Audio only: join on the audio stream and drop any video\n");
                 fprintf(stderr,"   -n              Don't write metadata to output file\n");
                 fprintf(stderr,"   -q              Don't display progress information\n");
                 fprintf(stderr,"   -h              Display this usage message and exit\n");
@@ -111,91 +287,183 @@ int main (int argc, char ** argv)
         }
     }
 
-    if( strlen(filepath) == 0 )
+    if( strlen(source) > 0 )
+    {
+        if( strlen(output.path) > 0 || update_output || follow_timeout >= 0 || split_interval )
+        {
+            fprintf(stderr, "ERROR: The -o, -s, -u and -w options can't be used with -c.\n");
+            exit(1);
+        }
+        extract_clips(source);
+        exit(0);
+    }
+
+    if( strlen(output.path) == 0 )
     {
         fprintf(stderr, "ERROR: Output file must be specified with the -o option. (Use - for stdout).\n");
         exit(1);
     }
 
+    if( output.tee && (update_output || split_interval) )
+    {
+        fprintf(stderr, "ERROR: The -s and -u options can't be used with several output files.\n");
+        exit(1);
+    }
+
+    if( (resume && (!checkpoint_path || update_output)) ||
+        (checkpoint_path && (output.tee || split_interval || strcmp(output.path, "-") == 0)) )
+    {
+        fprintf(stderr, "ERROR: -r needs -k and can't be used with -u; -k needs a single output file and can't be used with -s.\n");
+        exit(1);
+    }
+
+    if( atomic_output && (update_output || checkpoint_path) )
+    {
+        fprintf(stderr, "ERROR: The -k and -u options can't be used with -t.\n");
+        exit(1);
+    }
+
+    if( split_interval )
+    {
+        if( update_output || !check_pattern(output.path) )
+        {
+            fprintf(stderr, "ERROR: With -s, the output filename must contain one %%d (and -u can't be used).\n");
+            exit(1);
+        }
+        strcpy(split_pattern, output.path);
+        chunk_name(&output);
+    }
+
     {
         struct stat s;
-        struct FLVpacket *packet;
         
-        if( strcmp(filepath, "-") != 0 && stat(filepath, &s) == 0 )
+        if( update_output && strcmp(output.path, "-") == 0 )
         {
-            fprintf(stderr,"ERROR: File %s exists; won't write header.\n", filepath);
+            fprintf(stderr, "ERROR: Can't append to standard output.\n");
             exit(1);
-        }       
-        open_output("wb"); /* Open for writing */
-        write_flv_header();
-        /* Write blank metadata */
-        if(!no_meta)
+        }
+        if( resume )
+            resume_output(&output);
+        else if( update_output && stat(output.path, &s) == 0 )
+        {
+            open_output(&output, "r+b"); /* Open for updating */
+            recover_output(&output);
+        }
+        else
         {
-            packet = generate_metadata_packet(outfile);
-            write_packet(packet, 0);
+            if( strcmp(output.path, "-") != 0 && stat(output.path, &s) == 0 )
+            {
+                fprintf(stderr,"ERROR: File %s exists; won't write header.\n", output.path);
+                exit(1);
+            }       
+            open_output(&output, "wb"); /* Open for writing */
         }
     }
 
-    /* Read an input filename at a time from stdin and append to output */
-    while( fgets(buffer, sizeof(buffer), stdin) )
+    checkpoint_size = output.totals.data_size;
+
+    if( output.tee )
     {
-        int num_params;
-        double mark_in, mark_out;
-        char infile[MAX_NAME_LEN];
-        char *newline = strchr(buffer, '\n');
-        if(newline) /* Remove newline character */
-            *newline = '\0';
+        /* Every destination gets the same data; those that can't be
+         * rewound at the end get no metadata */
+        struct FLVwriter *t;
+        struct stat s;
 
-        num_params = sscanf(buffer, "%1023s %lf %lf", infile, &mark_in, &mark_out);
-        if(num_params < 3)
-            mark_out = 99999;
-        if(num_params < 2)
-            mark_in = 0;
-        append_file(infile, (unsigned int)(0.5 + mark_in*1000), (unsigned int)(0.5 + mark_out*1000));
+        for( t = output.tee; t; t = t->tee )
+        {
+            if( strcmp(t->path, "-") != 0 && stat(t->path, &s) == 0 )
+            {
+                fprintf(stderr,"ERROR: File %s exists; won't write header.\n", t->path);
+                exit(1);
+            }
+            open_output(t, "wb");
+        }
+        for( t = &output; t; t = t->tee )
+            t->omit_meta = !t->seekable;
     }
 
-    /* Determine file duration based on last timestamp and the duration of that packet */
-    if(!no_meta)
+    /* Read an input filename at a time from stdin and append to output. When
+     * following, read one line ahead so we know which input is the last. */
     {
-        unsigned int duration;
-       
-        /* Rewind and write metadata */
-        if(!quiet)
-            fprintf(stderr, "Writing metadata...\n");
-
-        if(last_video_timestamp >= last_audio_timestamp)
-            duration = last_video_timestamp + frame_interval;
-        else
-            duration = last_audio_timestamp + (unsigned int)(0.5 + 1000.0 * last_packet_size * 8 / audio_bitrate);
+        int have_line = fgets(buffer, sizeof(buffer), stdin) != NULL;
 
-        write_metadata(outfile, duration);
+        while( have_line )
+        {
+            int num_params;
+            double mark_in, mark_out;
+            char infile[MAX_NAME_LEN];
+            char *newline = strchr(buffer, '\n');
+            if(newline) /* Remove newline character */
+                *newline = '\0';
+
+            num_params = sscanf(buffer, "%1023s %lf %lf", infile, &mark_in, &mark_out);
+            if(num_params < 3)
+                mark_out = OPEN_MARK_OUT;
+            if(num_params < 2)
+                mark_in = 0;
+            if( follow_timeout >= 0 )
+                have_line = fgets(buffer, sizeof(buffer), stdin) != NULL;
+            if( resume && input_number <= resume_point.input )
+                /* Already joined, but its metadata and sequence header may
+                 * still be needed */
+                prescan_file(infile);
+            if( !resume || input_number >= resume_point.input )
+                append_file(&output, infile, (unsigned int)(0.5 + mark_in*1000), (unsigned int)(0.5 + mark_out*1000),
+                            follow_timeout >= 0 && !have_line);
+            input_number++;
+            write_checkpoint(&output, 0, 0);
+            if( follow_timeout < 0 )
+                have_line = fgets(buffer, sizeof(buffer), stdin) != NULL;
+        }
     }
 
-    if( !quiet )
-        fprintf(stderr, "Closing output file %s\n", filepath);
-    close_output();
+    finish_output(&output);
+    if( checkpoint_path )
+        remove(checkpoint_path); /* The join is complete */
 
     exit(0);
 }
 
+/*
+ * init_writer()
+ * 
+ * Set up writer "w" for an output file that has nothing written to it yet.
+ * The caller fills in the path and opens the file.
+ */
+static void init_writer(struct FLVwriter *w)
+{
+    memset(w, 0, sizeof(*w));
+    w->first_time = 1;
+    w->meta_offset = -1;
+    w->last_audio_timestamp = -1;
+    w->totals.last_timestamp = -1;
+    w->totals.last_keyframe_timestamp = -1;
+
+    return;
+}
+
 /*
  * write_flv_header()
  * 
- * Write the standard 13-byte header found in all FLV files to the stream
- * specified by "outfile".
+ * Write the standard 13-byte header found in all FLV files to the output
+ * of writer "w".
  * This header specifies that the file contains both audio and video streams,
  * i.e. byte nymber 5 is (0x4 | 0x1) = 0x5.
  *                          ^     ^
  *                  audio---|     |---video
+ * In audio-only mode only the audio flag (0x4) is set.
  */
-static void write_flv_header(void)
+static void write_flv_header(struct FLVwriter *w)
 {
-    const unsigned char header[] = {'F', 'L', 'V', 1, 5, 0, 0, 0, 9, 0, 0, 0, 0};
+    unsigned char header[] = {'F', 'L', 'V', 1, 5, 0, 0, 0, 9, 0, 0, 0, 0};
+
+    if(audio_only)
+        header[4] = 4;
 
     if(!quiet)
-        fprintf(stderr,"Writing FLV header to %s\n", filepath);
+        fprintf(stderr,"Writing FLV header to %s\n", w->path);
 
-    fwrite( header, 1, sizeof(header), outfile );
+    write_output( w, header, sizeof(header) );
 
     return;
 }      
@@ -210,7 +478,10 @@ static void write_flv_header(void)
  * FLVpacket struct. Non-video or audio packets (e.g. metadata packets) are 
  * skipped over and not parsed any further than the header. Video and audio
  * packets have their data payload and closing back pointer also stored in 
- * memory.
+ * memory, unless the payload is too large for the memory budget; in that
+ * case only its first few bytes are kept and the rest is later copied
+ * straight from the input file (or from the spill file if the input isn't
+ * seekable).
  * If the starting timestamp for the current output file has already been 
  * determined, write_packet() is then called to write the packet to the output
  * file. Otherwise the packets are buffered using buffer_packet() until the
@@ -219,20 +490,31 @@ static void write_flv_header(void)
  * video framerate, and the timestamp of the last video packet read from the
  * previous input file. The packet buffer is then flushed and operation
  * reverts to simply reading packets from input and writing to output.
+ * If an in-point or out-point is given, the file is first indexed and only
+ * the tags between those points (plus any script tags and AVC sequence
+ * headers) are read; the rest are skipped over.
+ * Each tag is checked before it is read; if the tag is damaged, the file is
+ * searched for the next sound tag and reading resumes from there.
+ * If "follow" is non-zero the file may still be growing: instead of stopping
+ * at the end of the data, each tag is waited for until it is complete (see
+ * wait_for_input()). A growing file isn't mapped, so it is neither checked
+ * for damage nor indexed.
  * When no more data can be read from the input file, it is closed and the 
  * function returns.
  */
-static void append_file(const char *filename, unsigned int mark_in, unsigned int mark_out)
+static void append_file(struct FLVwriter *w, const char *filename, unsigned int mark_in, unsigned int mark_out, int follow)
 {
-    static unsigned char *buff;
-    static size_t buffsize = 13;
-    static char first_time = 1;
-    static char metadata_extracted;
+    unsigned char buff[16];
     long file_start_timestamp = -999999;
     long first_keyframe_timestamp = -1;
-    unsigned int lastfile_video_timestamp = last_video_timestamp;
+    unsigned int lastfile_video_timestamp = w->last_video_timestamp;
     unsigned char signature[] = { 'F', 'L', 'V' };
     FILE *infile;
+    struct FLVindex index;
+    struct FLVmap map;
+    long first_tag = 0, last_tag = -1;
+    size_t tagno = 0, in_pos, available = 0, cache_dropped = 0;
+    int file_audio_only = force_audio_only;
 
     if(!quiet)
         fprintf(stderr, "Opening \"%s\"\n", filename);
@@ -244,11 +526,21 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
         return;
     }
 
-    if( !buff )
-        buff = malloc(buffsize);
+    if( follow )
+    {
+        /* Finish cleanly, writing the metadata, when told to stop following;
+         * until then these signals keep their usual effect */
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_stop;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGUSR1, &sa, NULL);
+    }
 
     /* 9B = normal length of header */
-    if( fread( buff, 1, 9, infile ) != 9 )
+    if( (follow && !wait_for_input(w, infile, 9, &available)) || fread( buff, 1, 9, infile ) != 9 )
     {
         fprintf(stderr, "ERROR reading header from input file %s: %s\n",
                 filename, strerror(errno));
@@ -272,28 +564,145 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
             fprintf(stderr, "WARNING: No audio stream present in input file\n");
 
         if( !(buff[4] & 1) )
-            fprintf(stderr, "WARNING: No video stream present in input file\n");
+        {
+            if( !audio_only )
+                fprintf(stderr, "WARNING: No video stream present in input file\n");
+            if( buff[4] & 4 )
+                file_audio_only = 1;
+        }
 
         header_length = (size_t)conv_ui32(&buff[5]);
-        if( (header_length + 4) > buffsize ) /* Add 4 to include 1st back-pointer */
-        {
-            buffsize = header_length + 4;
-            buff = realloc( buff, buffsize );
-        }       
-        extra_length = header_length - 9;
-        fread( buff + 9, 1, extra_length + 4, infile );
+        extra_length = header_length > 9 ? header_length - 9 : 0;
+        if( follow && !wait_for_input(w, infile, 9 + extra_length + 4, &available) )
+            follow = 0; /* Nothing more will arrive; the loop below will stop at once */
+        skip_input( infile, extra_length + 4 ); /* Add 4 to include 1st back-pointer */
     }
     else
         rewind(infile); /* It looks like the file contains raw FLV packets; rewind and start again. */
 
+    in_pos = ftell(infile);
+
+    /* Map regular files so each tag can be checked before it is read, and
+     * damaged data skipped over. The join reads the input once, in order,
+     * so it is left to be paged in as it is reached; a file that can't be
+     * mapped is just read without the checks, never copied into memory. */
+    if( follow || map_only(infile, &map, 0) != 0 )
+        map.length = 0;
+
+    /* Many files without video still claim it in the header flags */
+    if( !file_audio_only && map.length > 0 )
+        file_audio_only = detect_audio_only(&map, in_pos);
+    if( !w->started && file_audio_only && !audio_only )
+    {
+        /* The first file decides what the output contains */
+        audio_only = 1;
+        if( !quiet )
+            fprintf(stderr, "%s: No video found; joining audio only\n", filename);
+    }
+    /* Video is dropped from audio-only output, so it can't set the clock */
+    file_audio_only |= audio_only;
+
+    index.count = 0;
+    if( resume && input_number == resume_point.input && resume_point.input_offset > 0 )
+    {
+        /* Carry on from the checkpoint; the index isn't needed */
+        in_pos = resume_point.input_offset;
+        fseek( infile, (long)in_pos, SEEK_SET );
+        file_start_timestamp = resume_point.file_start_timestamp;
+        if(!quiet)
+            fprintf(stderr, "%s: Resuming at byte %lu\n", filename, (unsigned long)in_pos);
+    }
+    else if( map.length > 0 && (mark_in > 0 || mark_out < OPEN_MARK_OUT * 1000) &&
+             (!mem_budget || mem_used < mem_budget) )
+    {
+        /* Index the file so we can go straight to the tags we need (unless
+         * the memory budget is used up already, as a cap of 0 means none) */
+        if( index_build(&index, &map, mem_budget ? mem_budget - mem_used : 0) == 0 &&
+            mem_reserve(index_memory(&index)) )
+        {
+            first_tag = index_first_from(&index, mark_in, 0);
+            if( first_tag == -1 )
+                first_tag = index.count;
+            last_tag = index_last_before(&index, mark_out, 0);
+            if( !quiet )
+                fprintf(stderr, "%s: %d tags indexed; %llu bytes between in and out points\n",
+                        filename, (int)index.count,
+                        (unsigned long long)index_bytes(&index, mark_in, mark_out));
+        }
+        else
+            index_free(&index);
+    }
+
     while( !feof(infile) )
     {
         static struct FLVpacket packet;
         static size_t max_datasize = 0;
+        long payload_pos;
         size_t size;
         char key_frame = 0;
 
+        if( index.count > 0 )
+        {
+            size_t skip_from = tagno;
+
+            /* Skip over tags outside the in and out points, unless they might
+             * hold metadata or a sequence header */
+            while( tagno < index.count && ((long)tagno < first_tag || (long)tagno > last_tag) &&
+                   !(index.flags[tagno] & (TAG_SCRIPT | TAG_AVC_SEQHDR)) )
+                tagno++;
+            if( tagno >= index.count )
+            {
+                size_t index_end = index_offset(&index, index.count - 1) +
+                                   index.sizes[index.count - 1] + 15;
+
+                if( index_end >= map.length )
+                    break;
+                /* The index stopped short at damaged data, which may be
+                 * hiding more tags before the out point; carry on tag by tag */
+                mem_release(index_memory(&index));
+                index_free(&index);
+                index.count = 0;
+                in_pos = index_end;
+                fseek( infile, (long)in_pos, SEEK_SET );
+            }
+            else
+            {
+                if( tagno != skip_from )
+                {
+                    in_pos = index_offset(&index, tagno);
+                    fseek( infile, (long)in_pos, SEEK_SET );
+                }
+                tagno++;
+            }
+        }
+
+        if( in_pos < map.length && !scan_tag_valid(map.base, map.length, in_pos) )
+        {
+            /* Damaged tag; skip to the next one that looks sound */
+            size_t next = scan_resync(map.base, map.length, in_pos + 1);
+
+            if( !quiet && next < map.length )
+                fprintf(stderr, "WARNING: %s: bytes %lu to %lu are damaged; skipped\n",
+                        filename, (unsigned long)in_pos, (unsigned long)next - 1);
+            else if( !quiet )
+                fprintf(stderr, "WARNING: %s: bytes %lu to end of file are damaged or truncated; skipped\n",
+                        filename, (unsigned long)in_pos);
+            if( index.count > 0 )
+            {
+                /* Tag numbers no longer match the file position */
+                mem_release(index_memory(&index));
+                index_free(&index);
+                index.count = 0;
+            }
+            if( next >= map.length )
+                break;
+            in_pos = next;
+            fseek( infile, (long)in_pos, SEEK_SET );
+        }
+
         /* Read the tag header (11 bytes) */
+        if( follow && !wait_for_input(w, infile, in_pos + 11, &available) )
+            break;
         size = fread( buff, 1, 11, infile );
 
         if( size == 0 )
@@ -319,22 +728,63 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
         packet.datasize = conv_ui24(&buff[1], 0);
         packet.timestamp = conv_ui24(&buff[4], buff[7]);
         packet.streamid = conv_ui24(&buff[8], 0);
-        if( packet.datasize > max_datasize )
+        packet.src = NULL;
+        if( follow && !wait_for_input(w, infile, in_pos + packet.datasize + 15, &available) )
+            break;
+        if( !packet.data )
+        {
+            /* packet declared as static so packet.data will have been initialised to NULL.
+             * Always keep room for at least the head of a payload. */
+            max_datasize = PAYLOAD_HEAD;
+            mem_used += max_datasize;
+            packet.data = malloc( max_datasize );
+        }
+        if( packet.datasize > max_datasize &&
+            mem_reserve(packet.datasize - max_datasize) )
         {
             max_datasize = packet.datasize;
-            /* packet declared as static so packet.data will have been initialised to NULL */
             packet.data = realloc( packet.data, max_datasize );
         }
-        fread( packet.data, 1, packet.datasize, infile );
+
+        if( packet.datasize <= max_datasize )
+            fread( packet.data, 1, packet.datasize, infile );
+        else if( (payload_pos = ftell(infile)) != -1 )
+        {
+            /* Too large for the memory budget: keep the head and remember
+             * where the payload is so it can be replayed when writing */
+            fread( packet.data, 1, PAYLOAD_HEAD, infile );
+            fseek( infile, payload_pos + packet.datasize, SEEK_SET );
+            packet.src = infile;
+            packet.offset = payload_pos;
+        }
+        else
+            /* Input isn't seekable; move the payload to the spill file */
+            spill_payload( &packet, infile );
         /* Read back-pointer */
         size = fread( buff, 1, 4, infile );
         /* backptr should equal the number of bytes in the whole packet including the payload and the
-         * header; could use it as a sanity check if necessary */
+         * header; a mismatch means the input is damaged, so write the correct value */
         packet.backptr = conv_ui32(buff);
+        if( size == 4 && packet.backptr != packet.datasize + 11 )
+        {
+            if(!quiet)
+                fprintf(stderr, "WARNING: Back-pointer %u doesn't match tag length %u in %s\n",
+                        packet.backptr, packet.datasize + 11, filename);
+            packet.backptr = packet.datasize + 11;
+        }
+        in_pos += packet.datasize + 15;
+        if( cache_neutral && in_pos - cache_dropped >= CACHE_WINDOW )
+            cache_dropped = drop_input_cache(infile, &map, cache_dropped, in_pos);
 
         if(packet.type == 18) /* Script data */
         {
-            if(!metadata_extracted && !no_meta)
+            if(packet.src)
+            {
+                if(!quiet)
+                    fprintf(stderr, "WARNING: Script tag of %d bytes exceeds memory budget; ignored\n",
+                            packet.datasize);
+            }
+            else if(!metadata_extracted && !no_meta)
             {
                 /* Attempt to extract metadata from this packet */
                 metadata_extracted = extract_metadata(&packet);
@@ -344,14 +794,20 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
             continue; /* Jump to next packet */
         }
 
-        if(packet.type == 9 &&
+        if(packet.type == 9 && packet.datasize >= 2 &&
            (packet.data[0] & 0x0f) == 7 && packet.data[1] == 0) /* AVC sequence header */
         {
             if(!seq_header_pkt.data)
             {
-                seq_header_pkt = packet;
-                seq_header_pkt.data = malloc(packet.datasize);
-                memcpy(seq_header_pkt.data, packet.data, packet.datasize);
+                if(!packet.src && mem_reserve(packet.datasize))
+                {
+                    seq_header_pkt = packet;
+                    seq_header_pkt.data = malloc(packet.datasize);
+                    memcpy(seq_header_pkt.data, packet.data, packet.datasize);
+                }
+                else if(!quiet)
+                    fprintf(stderr, "WARNING: AVC sequence header of %d bytes exceeds memory budget; ignored\n",
+                            packet.datasize);
             }
             continue; /* Jump to next packet */
         }
@@ -363,7 +819,7 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
 
         if( packet.type == 8 )
             key_frame = 1; /* All audio packets are keyframes */
-        else
+        else if(packet.datasize >= 1)
         {
             unsigned char frame_type = (packet.data[0] & 0xf0) >> 4;
             if(frame_type == 1)
@@ -372,17 +828,39 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
         if(first_keyframe_timestamp == -1 && key_frame)
             first_keyframe_timestamp = packet.timestamp;
 
-        if( file_start_timestamp == -999999 )
+        if( file_start_timestamp == -999999 && file_audio_only )
+        {
+            /* Synchronise on the audio stream; nothing needs to be buffered */
+            if( packet.type == 8 )
+            {
+                if(w->first_time)
+                {
+                    file_start_timestamp = -(long)packet.timestamp;
+                    w->first_time = 0;
+                }
+                else
+                    /* Start one audio frame after the end of the last file */
+                    file_start_timestamp = w->last_audio_timestamp + audio_frame_interval(w) - packet.timestamp;
+                if(!quiet)
+                    fprintf(stderr, "%s: File start timestamp set to %ld (First audio packet %d)\n",
+                            filename, file_start_timestamp, packet.timestamp);
+                write_packet( w, &packet, file_start_timestamp );
+                if( packet.src == spill_file )
+                    reset_spill();
+            }
+            /* Discard video packets received before the first audio packet */
+        }
+        else if( file_start_timestamp == -999999 )
         {
             if( packet.type == 9 ) /* Video packet */
             {
                 if(key_frame)
                 {
-                    if(first_time)
+                    if(w->first_time)
                     {
                         /* First packet processed (either audio or video) is effectively the start of file */
                         file_start_timestamp = -first_keyframe_timestamp;
-                        first_time = 0;
+                        w->first_time = 0;
                     }
                     else
                         /* Calculate starting timestamp based on video framerate */
@@ -390,21 +868,41 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
                     if(!quiet)
                         fprintf(stderr, "%s: File start timestamp set to %ld (First video keyframe %d)\n",
                                 filename, file_start_timestamp, packet.timestamp);
-                    buffer_packet( &packet, file_start_timestamp, 1); /* Flush buffer this time */
+                    buffer_packet( w, &packet, file_start_timestamp, 1); /* Flush buffer this time */
                 }
                 /* Discard non-keyframe video packets received before first keyframe packet */
             }
             else
                 /* Buffer packets until we get our first video keyframe that
                  * we can calculate the starting timestamp from */
-                buffer_packet( &packet, -1, 0 );
+                buffer_packet( w, &packet, -1, 0 );
         }
         else
+        {
             /* Write this packet to output stream */
-            write_packet( &packet, file_start_timestamp );
+            write_packet( w, &packet, file_start_timestamp );
+            if( packet.src == spill_file )
+                reset_spill();
+            /* Nothing is held back now, so the join can be resumed from here */
+            write_checkpoint( w, in_pos, file_start_timestamp );
+        }
 
     }
 
+    if( file_audio_only && !audio_only && (long)w->last_video_timestamp < w->last_audio_timestamp )
+        /* Make the next file's video follow on from this file's audio */
+        w->last_video_timestamp = w->last_audio_timestamp;
+
+    if( index.count > 0 )
+    {
+        mem_release(index_memory(&index));
+        index_free(&index);
+    }
+    if( map.length > 0 )
+        unmap_file(&map);
+    if( cache_neutral )
+        posix_fadvise(fileno(infile), 0, 0, POSIX_FADV_DONTNEED);
+
     if( !quiet )
         fprintf(stderr, "Closing %s\n", filename);
     if( fclose(infile) != 0 )
@@ -419,29 +917,58 @@ static void append_file(const char *filename, unsigned int mark_in, unsigned int
  * 
  * Add the FLV packet "packet" to an internal statically-held array of FLVpacket
  * structs. Duplicate the data payload and update the data pointer in the packet 
- * to point to the duplicated data.
+ * to point to the duplicated data. If the payload doesn't fit in the memory
+ * budget it is appended to the spill file instead, keeping only its head in
+ * memory. The array itself is charged to the budget too; once it can't grow,
+ * further packets are dropped (or, when flushing, written directly).
  * If "flush" is non-zero, write out all the packets in the buffer using 
  * write_packet() in order received, free all the memory used for the 
  * payloads and reset the packet buffer count to 0.
  * "file_start_timestamp" should contain the timestamp for the start of the 
  * current file, and is passed to write_packet() when flushing the buffer.
  */
-static void buffer_packet(struct FLVpacket *packet, long file_start_timestamp, char flush)
+static void buffer_packet(struct FLVwriter *w, struct FLVpacket *packet, long file_start_timestamp, char flush)
 {
     static struct FLVpacket *pktarray = NULL;
     static int packets = 0, max_packets = 0;
+    int stored = 0;
 
-    if( packets >= max_packets )
+    if( packets >= max_packets && mem_reserve(5 * sizeof(struct FLVpacket)) )
     {
         max_packets += 5;
         pktarray = realloc( pktarray, max_packets * sizeof(struct FLVpacket) );
     }
 
-    pktarray[packets] = *packet;
-    pktarray[packets].data = malloc(packet->datasize);
-    memcpy(pktarray[packets].data, packet->data, packet->datasize);
+    if( packets < max_packets )
+    {
+        pktarray[packets] = *packet;
+        if( !packet->src && mem_reserve(packet->datasize) )
+        {
+            pktarray[packets].data = malloc(packet->datasize);
+            memcpy(pktarray[packets].data, packet->data, packet->datasize);
+        }
+        else
+        {
+            if( !packet->src || packet->src != spill_file ) /* Otherwise it's there already */
+                spill_payload( &pktarray[packets], NULL );
+            /* Always keep the head, as for the packet being read */
+            mem_used += PAYLOAD_HEAD;
+            pktarray[packets].data = malloc(PAYLOAD_HEAD);
+            memcpy(pktarray[packets].data, packet->data,
+                   packet->datasize < PAYLOAD_HEAD ? packet->datasize : PAYLOAD_HEAD);
+        }
+        packets++;
+        stored = 1;
+    }
+    else if(!flush)
+    {
+        static char buffer_full;
 
-    packets++;
+        if(!buffer_full && !quiet)
+            fprintf(stderr, "WARNING: Packets before the first keyframe exceed memory budget; dropped\n");
+        buffer_full = 1;
+        return;
+    }
 
     if(flush) /* Flush the buffer and free all data */
     {         /* Don't free the FLVpacket array as we may use it again */
@@ -449,10 +976,15 @@ static void buffer_packet(struct FLVpacket *packet, long file_start_timestamp, c
 
         for( i = 0; i < packets; i++ )
         {
-            write_packet( &pktarray[i], file_start_timestamp );
+            write_packet( w, &pktarray[i], file_start_timestamp );
             free(pktarray[i].data);
+            mem_release(pktarray[i].src ? PAYLOAD_HEAD : pktarray[i].datasize);
         }
         packets = 0;
+        if(!stored) /* No room to buffer it, but it can be written directly */
+            write_packet( w, packet, file_start_timestamp );
+        /* Nothing refers to the spill file any more */
+        reset_spill();
     }
 
     return;   
@@ -465,125 +997,1602 @@ static void buffer_packet(struct FLVpacket *packet, long file_start_timestamp, c
  * output stream in the correct byte-stream format. The packet timestamp is
  * re-written on the fly after having "file_start_timestamp" added to it.
  * If the packet is an audio packet and the timestamp is less than or equal
- * to the value of "last_audio_timestamp", the packet is dropped and not
+ * to the last audio timestamp of writer "w", the packet is dropped and not
  * written.
  * 
- * If the packet being written is a video packet, global variable 
+ * If the packet being written is a video packet, the writer's
  * "last_video_timestamp" is updated to contain the value of the re-written
  * timestamp.
- * If the packet being written is an audio packet, global variable
+ * If the packet being written is an audio packet, the writer's
  * "last_audio_timestamp" is updated to contain the value of the re-written
  * timestamp.
+ * When the output is split (-s), a keyframe at least split_interval after
+ * the start of the current chunk first starts a new one with next_chunk().
  */
-static void write_packet(struct FLVpacket *packet, long file_start_timestamp)
+static void write_packet(struct FLVwriter *w, struct FLVpacket *packet, long file_start_timestamp)
 {
-    static char seq_header_written;
-    if(!seq_header_written && seq_header_pkt.data && packet->type == 9)
+    long chunk_timestamp;
+
+    if(packet->type != 18)
+        /* Source metadata has been read by now, so it can be passed through */
+        start_output(w);
+    if(audio_only && packet->type == 9)
+    {
+        static char video_dropped;
+
+        if(!video_dropped && !quiet)
+            fprintf(stderr, "WARNING: Dropping video packets from audio-only output\n");
+        video_dropped = 1;
+        return;
+    }
+    if(split_interval && w->started && is_split_point(packet) &&
+       (long)packet->timestamp + file_start_timestamp - w->chunk_start >= split_interval)
+        /* This keyframe starts the next chunk */
+        next_chunk(w, (long)packet->timestamp + file_start_timestamp);
+    if(!w->seq_header_written && seq_header_pkt.data && packet->type == 9)
     {
         /* Write sequence header immediately before first video packet */
-        seq_header_written = 1;
+        w->seq_header_written = 1;
         seq_header_pkt.timestamp = packet->timestamp;
-        write_packet(&seq_header_pkt, file_start_timestamp);
+        write_packet(w, &seq_header_pkt, file_start_timestamp);
     }
 
     /* Calculate new timestamp */
     packet->timestamp += file_start_timestamp;
     /* Drop any overlapping audio packets */
-    if( packet->type == 8 && (long)packet->timestamp <= last_audio_timestamp )
+    if( packet->type == 8 && (long)packet->timestamp <= w->last_audio_timestamp )
     {
         if(!quiet)
             fprintf(stderr, "Dropping overlapping audio packet with timestamp %d; last audio packet at %d\n",
-                    packet->timestamp, (unsigned int)last_audio_timestamp);
+                    packet->timestamp, (unsigned int)w->last_audio_timestamp);
         return;
     }
 
-    /* Write out first part of header (tag type and datasize) */
-    write_output(&packet->type, 1);
-    write_output(format_ui24(packet->datasize), 3);
+    /* Timestamps in a chunk of split output count from the chunk's start; a
+     * packet interleaved just before it goes at the very start */
+    chunk_timestamp = (long)packet->timestamp - w->chunk_start;
+    if( chunk_timestamp < 0 )
+        chunk_timestamp = 0;
+    write_tag(w, packet, chunk_timestamp);
+    if( split_interval && packet->type == 8 && packet->datasize >= 2 && packet->data && !packet->src &&
+        (packet->data[0] & 0xf0) >> 4 == 10 && packet->data[1] == 0 ) /* AAC sequence header */
+        keep_aac_header(packet);
+
+    if( packet->type == 9 ) /* Video packet */
+    {
+        /* Update timestamp - used in calculating first timestamp for new file */
+        w->last_video_timestamp = packet->timestamp;
+        w->totals.video_tags++;
+        w->totals.video_bytes += packet->datasize;
+        w->totals.video_size += packet->datasize + 15;
+        if( packet->datasize >= 2 && packet->data && (packet->data[0] & 0xf0) >> 4 == 1 &&
+            !((packet->data[0] & 0x0f) == 7 && packet->data[1] == 0) ) /* Not AVC sequence header */
+            w->totals.last_keyframe_timestamp = chunk_timestamp;
+    }
+    if( packet->type == 8 ) /* Audio packet */
+    {
+        /* Update timestamp - used to ensure audio tracks don't overlap when joining files */
+        if( w->last_audio_timestamp >= 0 && (long)packet->timestamp > w->last_audio_timestamp )
+            w->last_audio_interval = packet->timestamp - w->last_audio_timestamp;
+        w->last_audio_timestamp = packet->timestamp;
+        w->last_audio_size = packet->datasize;
+        w->totals.audio_tags++;
+        w->totals.audio_bytes += packet->datasize;
+        w->totals.audio_size += packet->datasize + 15;
+    }
+    if( (packet->type == 8 || packet->type == 9) && chunk_timestamp > w->totals.last_timestamp )
+        w->totals.last_timestamp = chunk_timestamp;
+    w->totals.data_size += packet->datasize + 15;
+    w->last_packet_size = packet->datasize;
+
+    return;   
+}
 
-    /* Write out timestamp ui24 value + top extension byte = 4 bytes to write out */
-    write_output(format_ui24(packet->timestamp), 4);
+/*
+ * write_tag()
+ * 
+ * Write the FLV packet "packet" to the output of writer "w" as a tag with
+ * timestamp "timestamp": the 11-byte tag header, the payload and the
+ * closing back-pointer.
+ */
+static void write_tag(struct FLVwriter *w, struct FLVpacket *packet, long timestamp)
+{
+    unsigned char header[11], *pos;
 
-    /* Write out streamid (should always be 0 anyway) */
-    write_output(format_ui24(packet->streamid), 3);
+    /* Assemble the 11-byte tag header: tag type, datasize, timestamp ui24
+     * value + top extension byte, and streamid (should always be 0 anyway) */
+    pos = header;
+    *pos++ = packet->type;
+    pos = encode_ui24(pos, packet->datasize);
+    pos = encode_timestamp(pos, (unsigned int)timestamp);
+    encode_ui24(pos, packet->streamid);
+    write_output(w, header, sizeof(header));
 
     /* Write out data payload */
-    write_output(packet->data, packet->datasize);
+    if( packet->src )
+        copy_payload(w, packet);
+    else
+        write_output(w, packet->data, packet->datasize);
 
     /* Write out closing back pointer */
-    write_output(format_ui32(packet->backptr), 4);
+    encode_ui32(header, packet->backptr);
+    write_output(w, header, 4);
 
-    if( packet->type == 9 ) /* Video packet */
-        /* Update timestamp - used in calculating first timestamp for new file */
-        last_video_timestamp = packet->timestamp;
-    if( packet->type == 8 ) /* Audio packet */
-        /* Update timestamp - used to ensure audio tracks don't overlap when joining files */
-        last_audio_timestamp = packet->timestamp;
-    last_packet_size = packet->datasize;
+    return;
+}
 
-    return;   
+/*
+ * mem_reserve()
+ * 
+ * Account for "bytes" more bytes of tag data being held in memory, if that
+ * can be done without exceeding the memory budget set with the -m option.
+ * 
+ * Returns 1 if the bytes were reserved, or 0 if the caller must fall back
+ * to keeping the data on disk.
+ */
+static int mem_reserve(size_t bytes)
+{
+    if( mem_budget && mem_used + bytes > mem_budget )
+        return 0;
+    mem_used += bytes;
+    return 1;
 }
 
 /*
- * open_output()
+ * mem_release()
+ * 
+ * Return "bytes" bytes previously obtained with mem_reserve() to the budget.
+ */
+static void mem_release(size_t bytes)
+{
+    mem_used -= bytes;
+    return;
+}
+
+/*
+ * spill_payload()
  * 
- * Opens the file with pathname specified by global variable "filepath" and
- * stores the pointer to the resulting stream in global variable "outfile".
- * Opens in binary mode for appending - thus if the program is stopped and
- * started during the course of a minute, the old data will not be overwritten.
+ * Append the payload of FLV packet "packet" to the spill file (creating it
+ * if necessary) and update the packet to refer to it there. If "in" is
+ * non-NULL the payload is read from the current position of that stream and
+ * its first PAYLOAD_HEAD bytes are also kept in packet->data; otherwise the
+ * payload is taken from wherever the packet currently holds it.
  * 
  * Prints an appropriate message to stderr and exits the program should an
- * error occur during opening the output.
+ * error occur creating or writing to the spill file.
  */
-static void open_output(const char *mode)
+static void spill_payload(struct FLVpacket *packet, FILE *in)
 {
-    if( strcmp(filepath, "-") == 0 )
-        outfile = stdout;    
-    else if( !(outfile = fopen(filepath, mode)) )
+    static unsigned char chunk[COPY_CHUNK];
+    int keep_head = (in != NULL);
+    size_t done = 0;
+    long offset, pos = -1;
+
+    if( !spill_file && !(spill_file = tmpfile()) )
     {
-        fprintf(stderr, "ERROR while opening output file %s for writing: %s\n",
-                filepath, strerror(errno));
+        fprintf(stderr, "ERROR while creating spill file: %s\n", strerror(errno));
         exit(1);
     }
+    fseek(spill_file, 0, SEEK_END);
+    offset = ftell(spill_file);
+
+    if( !in && packet->src )
+    {
+        in = packet->src;
+        pos = ftell(in);
+        fseek(in, packet->offset, SEEK_SET);
+    }
+
+    while( done < packet->datasize )
+    {
+        size_t n = packet->datasize - done;
+
+        if( n > COPY_CHUNK )
+            n = COPY_CHUNK;
+        if( in )
+        {
+            n = fread(chunk, 1, n, in);
+            if( n == 0 )
+                break; /* Truncated payload */
+            if( done == 0 && keep_head )
+                memcpy(packet->data, chunk, n < PAYLOAD_HEAD ? n : PAYLOAD_HEAD);
+        }
+        else
+            memcpy(chunk, packet->data + done, n);
+
+        if( fwrite(chunk, 1, n, spill_file) != n )
+        {
+            fprintf(stderr, "ERROR while writing to spill file: %s\n", strerror(errno));
+            exit(1);
+        }
+        done += n;
+    }
+    if( pos != -1 )
+        fseek(in, pos, SEEK_SET);
+
+    if( cache_neutral && offset + (long)done - spill_dropped >= CACHE_WINDOW &&
+        fflush(spill_file) == 0 )
+    {
+        int fd = fileno(spill_file);
+        long end = offset + done;
+
+        /* Dirty pages can't be dropped, so write them back first */
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(fd, spill_dropped, end - spill_dropped, SYNC_FILE_RANGE_WAIT_BEFORE |
+                        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+        fdatasync(fd);
+#endif
+        posix_fadvise(fd, spill_dropped, end - spill_dropped, POSIX_FADV_DONTNEED);
+        spill_dropped = end;
+    }
+
+    packet->src = spill_file;
+    packet->offset = offset;
     return;
 }
 
 /*
- * write_output()
+ * reset_spill()
  * 
- * Writes "bytes" bytes starting from the memory buffer at "buffer" to the
- * output stream specified by global variable "outfile".
+ * Discard the contents of the spill file once no packets refer to it.
+ */
+static void reset_spill(void)
+{
+    if( !spill_file )
+        return;
+
+    /* Truncating also frees whatever of it is still in the page cache */
+    rewind(spill_file);
+    if( ftruncate(fileno(spill_file), 0) != 0 )
+        fprintf(stderr, "WARNING: Unable to truncate spill file: %s\n", strerror(errno));
+    spill_dropped = 0;
+
+    return;
+}
+
+/*
+ * copy_payload()
  * 
- * Prints an appropriate message to stderr and exits the program should an
- * error or short count occur during writing.
+ * Write the payload of FLV packet "packet", which isn't held in memory, to
+ * the output by copying it in chunks from the stream it lives in. The
+ * position of that stream is restored afterwards.
  */
-static void write_output(unsigned char *buffer, size_t bytes)
+static void copy_payload(struct FLVwriter *w, struct FLVpacket *packet)
 {
-    if( fwrite(buffer, 1, bytes, outfile) != bytes )
+    static unsigned char chunk[COPY_CHUNK];
+    long pos = ftell(packet->src);
+    size_t done = 0;
+
+    fseek(packet->src, packet->offset, SEEK_SET);
+    while( done < packet->datasize )
     {
-        fprintf(stderr, "ERROR while writing to output file %s: %s\n",
-                filepath, strerror(errno));
-        exit(1);
+        size_t n = packet->datasize - done;
+
+        if( n > COPY_CHUNK )
+            n = COPY_CHUNK;
+        if( fread(chunk, 1, n, packet->src) != n )
+        {
+            /* Keep the output consistent with the header already written */
+            fprintf(stderr, "WARNING: Payload truncated at input offset %ld; padding with zeros\n",
+                    packet->offset + (long)done);
+            memset(chunk, 0, n);
+        }
+        write_output(w, chunk, n);
+        done += n;
     }
+    fseek(packet->src, pos, SEEK_SET);
+
     return;
 }
 
 /*
- * close_output()
+ * skip_input()
  * 
- * Closes the output stream specified by global variable "outfile".
- * 
- * Prints an appropriate message to stderr and exits the program should an
- * error occur during closing.
+ * Read and discard "bytes" bytes from the stream "in". Works on streams that
+ * aren't seekable and needs no more than a small fixed buffer.
  */
-static void close_output(void)
+static void skip_input(FILE *in, size_t bytes)
 {
-    if( outfile != stdout && fclose(outfile) != 0 )
+    unsigned char chunk[512];
+
+    while( bytes > 0 )
     {
-        fprintf(stderr, "ERROR while closing output file %s: %s\n",
-                filepath, strerror(errno));
-        exit(1);
+        size_t n = bytes > sizeof(chunk) ? sizeof(chunk) : bytes;
+
+        if( fread(chunk, 1, n, in) != n )
+            break;
+        bytes -= n;
     }
     return;
 }
 
+/*
+ * parse_size()
+ * 
+ * Convert the string "arg", a number of bytes optionally followed by one of
+ * the suffixes k, M or G, to a byte count.
+ * 
+ * Prints an error message to stderr and exits the program if "arg" isn't
+ * a size in that form.
+ */
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    double size = strtod(arg, &end);
+    int valid = (end != arg);
+
+    switch( *end )
+    {
+        case 'g': case 'G':
+            size *= 1024;
+            /* fall through */
+        case 'm': case 'M':
+            size *= 1024;
+            /* fall through */
+        case 'k': case 'K':
+            size *= 1024;
+            end++;
+            break;
+    }
+
+    /* Also rules out NaN */
+    if( !valid || *end != '\0' || !(size >= 0 && size < (double)SIZE_MAX) )
+    {
+        fprintf(stderr, "ERROR: Invalid size \"%s\"; use a number of bytes, optionally followed by k, M or G\n", arg);
+        exit(1);
+    }
+
+    return (size_t)size;
+}
+
+/*
+ * recover_output()
+ * 
+ * Prepare to append to the existing output file of writer "w" (opened for
+ * updating): recover the state left by the run that wrote it, so that the
+ * new input carries on from it as though it had been joined in the same run.
+ * The last timestamps and packet sizes are found by walking back from the
+ * end of the file along the back-pointers, the metadata fields and totals
+ * are found in the metadata packet so they can be updated in place, and the
+ * start of the file is examined for an AVC sequence header. An incomplete
+ * tag at the end of the file (left by an interrupted run) is cut off.
+ */
+static void recover_output(struct FLVwriter *w)
+{
+    struct FLVmap map;
+    struct FLVpacket packet;
+    size_t first, end;
+
+    if( map_file(w->path, &map) != 0 || map.length < 13 || memcmp(map.base, "FLV", 3) != 0 )
+    {
+        fprintf(stderr, "ERROR: %s is not an FLV file; can't append to it\n", w->path);
+        exit(1);
+    }
+    audio_only = !(map.base[4] & 1);
+    first = scan_header(map.base, map.length);
+
+    end = map.length;
+    if( !walk_back(w, &map, first, end) )
+    {
+        struct FLVcheck check;
+
+        /* The end of the file is damaged; keep everything before it */
+        check_file(&check, &map);
+        end = check.last_good_offset;
+        if( !quiet )
+            fprintf(stderr, "WARNING: %s: cutting off damaged data after byte %lu\n",
+                    w->path, (unsigned long)end);
+        if( ftruncate(fileno(w->out), end) != 0 )
+        {
+            fprintf(stderr, "ERROR while truncating output file %s: %s\n",
+                    w->path, strerror(errno));
+            exit(1);
+        }
+        walk_back(w, &map, first, end);
+    }
+
+    /* Our metadata packet comes first */
+    metadata_extracted = 1;
+    memset(&packet, 0, sizeof(packet)); /* No packet if there's no room for one */
+    if( first + 11 <= end )
+    {
+        packet.type = map.base[first];
+        packet.datasize = conv_ui24(map.base + first + 1, 0);
+        packet.data = (unsigned char *)map.base + first + 11;
+    }
+    if( no_meta || first + 15 + packet.datasize > end ||
+        !locate_metadata(&packet, &w->totals) )
+    {
+        if( !no_meta && !quiet )
+            fprintf(stderr, "WARNING: %s has no metadata; none will be written\n", w->path);
+        no_meta = 1;
+    }
+
+    w->meta_offset = first + 11;
+
+    /* A sequence header has been written if there is one near the start */
+    {
+        struct FLVscan scan;
+        size_t i;
+
+        memset(&scan, 0, sizeof(scan));
+        scan_tags(map.base, end, first, &scan, AUDIO_DETECT_TAGS);
+        for( i = 0; i < scan.count; i++ )
+        {
+            const unsigned char *payload = map.base + scan.offsets[i] + 11;
+
+            if( scan.types[i] == 9 && scan.sizes[i] >= 2 && (payload[0] & 0x0f) == 7 && payload[1] == 0 )
+                w->seq_header_written = 1;
+        }
+        scan_free(&scan);
+    }
+
+    if( !quiet )
+        fprintf(stderr, "Appending to %s after byte %lu (last video %u ms, last audio %ld ms)\n",
+                w->path, (unsigned long)end, w->last_video_timestamp, w->last_audio_timestamp);
+    unmap_file(&map);
+
+    w->started = 1;
+    w->first_time = 0;
+    fseek(w->out, 0, SEEK_END);
+
+    return;
+}
+
+/*
+ * walk_back()
+ * 
+ * Walk back along the back-pointers from byte offset "end" of the mapped
+ * output file "map" (whose first tag is at offset "first") until the last
+ * video packet and the last two audio packets have been seen, and set the
+ * last timestamps and packet sizes from them.
+ * 
+ * Returns 1 if the tag ending at "end" is sound, or 0 if it isn't (in which
+ * case nothing is set).
+ */
+static int walk_back(struct FLVwriter *w, const struct FLVmap *map, size_t first, size_t end)
+{
+    size_t pos = end;
+    int video_seen = 0, audio_seen = 0;
+
+    while( pos > first && !(video_seen && audio_seen >= 2) )
+    {
+        size_t backptr, start;
+        unsigned int datasize, timestamp;
+        unsigned char type;
+
+        if( pos - first < 15 )
+            break;
+        backptr = conv_ui32(map->base + pos - 4);
+        if( backptr < 11 || backptr > pos - first - 4 )
+            break;
+        start = pos - 4 - backptr;
+        datasize = conv_ui24(map->base + start + 1, 0);
+        if( !scan_tag_valid(map->base, pos, start) || start + 15 + datasize != pos )
+            break;
+        type = map->base[start];
+        timestamp = conv_ui24(map->base + start + 4, map->base[start + 7]);
+
+        if( pos == end )
+            w->last_packet_size = datasize;
+        if( type == 9 && !video_seen )
+        {
+            w->last_video_timestamp = timestamp;
+            video_seen = 1;
+        }
+        if( type == 8 )
+        {
+            if( audio_seen == 0 )
+            {
+                w->last_audio_timestamp = timestamp;
+                w->last_audio_size = datasize;
+            }
+            else if( audio_seen == 1 && (long)timestamp < w->last_audio_timestamp )
+                w->last_audio_interval = w->last_audio_timestamp - timestamp;
+            audio_seen++;
+        }
+        if( (type == 8 || type == 9) && (long)timestamp > w->totals.last_timestamp )
+            w->totals.last_timestamp = timestamp;
+        pos = start;
+    }
+
+    return pos < end || end == first;
+}
+
+/*
+ * detect_audio_only()
+ * 
+ * Examine up to AUDIO_DETECT_TAGS tags of the mapped input file "map",
+ * starting from byte offset "offset".
+ * 
+ * Returns 1 if they include audio but no video, otherwise 0.
+ */
+static int detect_audio_only(const struct FLVmap *map, size_t offset)
+{
+    struct FLVscan scan;
+    int audio = 0, video = 0;
+    size_t i;
+
+    memset(&scan, 0, sizeof(scan));
+    scan_tags(map->base, map->length, offset, &scan, AUDIO_DETECT_TAGS);
+    for( i = 0; i < scan.count; i++ )
+    {
+        if( scan.types[i] == 8 )
+            audio = 1;
+        else if( scan.types[i] == 9 )
+            video = 1;
+    }
+    scan_free(&scan);
+
+    return audio && !video;
+}
+
+/*
+ * wait_for_input()
+ * 
+ * Wait until the input file "infile", which may still be growing, holds at
+ * least "length" bytes. "*available" holds the length the file was last
+ * seen to have (initially 0), so the file is only examined when a tag
+ * goes past it. The output is flushed before waiting, so everything read so
+ * far can be seen by its readers.
+ * 
+ * Returns 1 once the data is there, or 0 if the file hasn't grown for
+ * follow_timeout seconds or a signal has asked us to stop.
+ */
+static int wait_for_input(struct FLVwriter *w, FILE *infile, size_t length, size_t *available)
+{
+    struct timespec poll = { FOLLOW_POLL_MS / 1000, (FOLLOW_POLL_MS % 1000) * 1000000L };
+    long idle_ms = 0;
+
+    for( ;; )
+    {
+        struct stat st;
+
+        if( stop_following )
+            return 0;
+        if( length <= *available )
+            return 1;
+        if( fstat(fileno(infile), &st) == 0 && (size_t)st.st_size > *available )
+        {
+            *available = st.st_size;
+            idle_ms = 0;
+            continue;
+        }
+        if( idle_ms >= follow_timeout * 1000L )
+        {
+            if( !quiet )
+                fprintf(stderr, "No new data for %d seconds; stopping\n", follow_timeout);
+            return 0;
+        }
+        if( idle_ms == 0 )
+            flush_output(w);
+        nanosleep(&poll, NULL);
+        idle_ms += FOLLOW_POLL_MS;
+        clearerr(infile);
+    }
+}
+
+/*
+ * handle_stop()
+ * 
+ * Signal handler asking a follow to finish.
+ */
+static void handle_stop(int sig)
+{
+    (void)sig; /* Every signal handled means the same */
+    stop_following = 1;
+}
+
+/*
+ * audio_frame_interval()
+ * 
+ * Estimate the duration in ms of the last audio packet written: the interval
+ * between the last two audio packets if known, otherwise its size at the
+ * audio bitrate.
+ */
+static long audio_frame_interval(struct FLVwriter *w)
+{
+    if( w->last_audio_interval > 0 )
+        return w->last_audio_interval;
+    return (long)(0.5 + 1000.0 * w->last_audio_size * 8 / audio_bitrate);
+}
+
+/*
+ * start_output()
+ * 
+ * Write the FLV header and the metadata packet, if this hasn't been done
+ * yet. Both are held back until just before the first audio or video packet,
+ * when it is known whether the output will have video and the first input
+ * file's metadata has been read.
+ */
+static void start_output(struct FLVwriter *w)
+{
+    if(w->started)
+        return;
+    w->started = 1;
+    write_flv_header(w);
+    write_metadata_packet(w);
+
+    return;
+}
+
+/*
+ * write_metadata_packet()
+ * 
+ * Write the metadata packet, with placeholders for the values that are
+ * only known at the end, unless metadata is disabled. Destinations that
+ * can't be patched at the end are left without it when there are several.
+ */
+static void write_metadata_packet(struct FLVwriter *w)
+{
+    struct FLVpacket *packet;
+    struct FLVwriter *t;
+
+    if(no_meta)
+        return;
+    /* Find the position in a destination that will be patched */
+    for( t = w; t->tee && !t->seekable; t = t->tee )
+        ;
+    settle_output(t);
+    w->meta_offset = ftell(t->out) + 11; /* Take account of size of packet header */
+    packet = generate_metadata_packet();
+    w->writing_meta = 1;
+    write_packet(w, packet, 0);
+    w->writing_meta = 0;
+    free(packet->data);
+    free(packet);
+
+    return;
+}
+
+/*
+ * open_output()
+ * 
+ * Opens the file with pathname "w->path" in mode "mode" and stores the
+ * pointer to the resulting stream in "w->out". Notes whether the stream is
+ * a regular file, whose metadata can be filled in at the end. New files
+ * for atomic output are opened with open_temporary() instead.
+ * 
+ * Prints an appropriate message to stderr and exits the program should an
+ * error occur during opening the output.
+ */
+static void open_output(struct FLVwriter *w, const char *mode)
+{
+    if( strcmp(w->path, "-") == 0 )
+        w->out = stdout;    
+    else if( atomic_output && mode[0] == 'w' )
+        open_temporary(w);
+    else if( !(w->out = fopen(w->path, mode)) )
+    {
+        fprintf(stderr, "ERROR while opening output file %s for writing: %s\n",
+                w->path, strerror(errno));
+        exit(1);
+    }
+    {
+        struct stat s;
+
+        w->seekable = fstat(fileno(w->out), &s) == 0 && S_ISREG(s.st_mode);
+    }
+    w->stdio_only = 0; /* io_uring may have room for this file */
+    return;
+}
+
+/*
+ * open_temporary()
+ * 
+ * Open a temporary file for the atomic output of writer "w", in the same
+ * directory as "w->path" so that it can be moved into place when complete.
+ * The file is created unnamed with O_TMPFILE where the system supports it,
+ * so nothing is left behind if the program dies; otherwise it is given a
+ * hidden name, stored in "w->tmp_path".
+ * 
+ * Prints an appropriate message to stderr and exits the program should an
+ * error occur creating the file.
+ */
+static void open_temporary(struct FLVwriter *w)
+{
+    char dir[MAX_NAME_LEN];
+    const char *name = output_dir(dir, w->path);
+    int fd = -1;
+
+    w->tmp_path[0] = '\0';
+#ifdef O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR, 0666);
+#endif
+    if( fd == -1 )
+    {
+        /* Not supported here (or by this file system) */
+        mode_t mask = umask(0);
+
+        umask(mask);
+        snprintf(w->tmp_path, sizeof(w->tmp_path), "%s/.%s.XXXXXX", dir, name);
+        if( (fd = mkstemp(w->tmp_path)) != -1 )
+            fchmod(fd, 0666 & ~mask);
+    }
+    if( fd == -1 || !(w->out = fdopen(fd, "w+b")) )
+    {
+        fprintf(stderr, "ERROR while creating temporary file for %s: %s\n",
+                w->path, strerror(errno));
+        exit(1);
+    }
+    w->temporary = 1;
+
+    return;
+}
+
+/*
+ * output_dir()
+ * 
+ * Store the name of the directory holding the file "path" in "dir", which
+ * must have room for MAX_NAME_LEN bytes.
+ * 
+ * Returns a pointer to the file's own name within "path".
+ */
+static const char *output_dir(char *dir, const char *path)
+{
+    const char *name = strrchr(path, '/');
+
+    if( !name )
+    {
+        strcpy(dir, ".");
+        return path;
+    }
+    snprintf(dir, MAX_NAME_LEN, "%.*s", name == path ? 1 : (int)(name - path), path);
+
+    return name + 1;
+}
+
+/*
+ * publish_output()
+ * 
+ * Give the completed temporary file of writer "w" its real name: link the
+ * unnamed file into the directory, or rename the hidden one. With -y the
+ * directory is then flushed to disk too, so the name survives a crash.
+ * 
+ * Prints an appropriate message to stderr and exits the program should an
+ * error occur.
+ */
+static void publish_output(struct FLVwriter *w)
+{
+    int ret;
+
+    if( fflush(w->out) != 0 )
+        ret = -1;
+    else if( w->tmp_path[0] == '\0' )
+    {
+        char fd_path[64];
+
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fileno(w->out));
+        ret = linkat(AT_FDCWD, fd_path, AT_FDCWD, w->path, AT_SYMLINK_FOLLOW);
+    }
+    else
+        ret = rename(w->tmp_path, w->path);
+    if( ret != 0 )
+    {
+        fprintf(stderr, "ERROR while moving output file %s into place: %s\n",
+                w->path, strerror(errno));
+        exit(1);
+    }
+    w->temporary = 0;
+
+    if( sync_output )
+    {
+        char dir[MAX_NAME_LEN];
+        int fd;
+
+        output_dir(dir, w->path);
+        if( (fd = open(dir, O_RDONLY)) == -1 || fsync(fd) != 0 )
+            fprintf(stderr, "WARNING: Unable to flush directory %s to disk: %s\n",
+                    dir, strerror(errno));
+        if( fd != -1 )
+            close(fd);
+    }
+
+    return;
+}
+
+/*
+ * write_output()
+ * 
+ * Writes "bytes" bytes starting from the memory buffer at "buffer" to the
+ * output stream of writer "w", and to each further destination teed from
+ * it. The data is only read once, whatever the number of destinations.
+ * With -i, regular files are written through an io_uring queue, set up on
+ * the first write; if that can't be done, stdio is used as usual.
+ * 
+ * Prints an appropriate message to stderr and exits the program should an
+ * error or short count occur during writing.
+ */
+static void write_output(struct FLVwriter *w, unsigned char *buffer, size_t bytes)
+{
+    struct FLVwriter *t;
+
+    for( t = w; t; t = t->tee )
+    {
+        if( w->writing_meta && t->omit_meta )
+            continue;
+        if( use_uring && t->seekable && !t->ring && !t->stdio_only && fflush(t->out) == 0 &&
+            !(t->ring = start_uring(t)) )
+        {
+            if( errno == EBUSY )
+                /* The shared buffers are spoken for by other output files */
+                t->stdio_only = 1;
+            else
+            {
+                if( !quiet )
+                    fprintf(stderr, "WARNING: io_uring not available (%s); using ordinary writes\n",
+                            strerror(errno));
+                use_uring = 0;
+            }
+        }
+        if( t->ring ? uring_write(t->ring, buffer, bytes) != 0 :
+            fwrite(buffer, 1, bytes, t->out) != bytes )
+        {
+            fprintf(stderr, "ERROR while writing to output file %s: %s\n",
+                    t->path, strerror(errno));
+            exit(1);
+        }
+        if( cache_neutral && t->seekable && (t->cache_pending += bytes) >= CACHE_WINDOW )
+            drop_output_cache(t, 0);
+    }
+    return;
+}
+
+/*
+ * start_uring()
+ * 
+ * Start writing the output of writer "w" through io_uring. On first use
+ * the queue is set up, with buffers shared by all output files. They are
+ * charged to the memory budget (-m), taking as much of URING_MEMORY as it
+ * allows.
+ * 
+ * Returns the io_uring handle for the file, or NULL (with errno set) if
+ * io_uring can't be used.
+ */
+static struct FLVuring *start_uring(struct FLVwriter *w)
+{
+    static size_t uring_memory;
+
+    if( !uring_memory )
+    {
+        size_t bytes;
+
+        for( bytes = URING_MEMORY; bytes >= URING_MIN_MEMORY; bytes /= 2 )
+            if( mem_reserve(bytes) )
+                break;
+        if( bytes < URING_MIN_MEMORY )
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+        if( !(uring_memory = uring_setup(bytes)) )
+        {
+            int saved = errno;
+
+            mem_release(bytes);
+            errno = saved;
+            return NULL;
+        }
+        mem_release(bytes - uring_memory);
+    }
+
+    return uring_open(fileno(w->out), ftell(w->out));
+}
+
+/*
+ * flush_output()
+ * 
+ * Flushes the output stream of writer "w" and of each destination teed
+ * from it.
+ */
+static void flush_output(struct FLVwriter *w)
+{
+    for( ; w; w = w->tee )
+    {
+        settle_output(w);
+        fflush(w->out);
+    }
+    return;
+}
+
+/*
+ * settle_output()
+ * 
+ * If the output of writer "w" (alone) is written through io_uring, wait
+ * for everything queued to be written and move the stream to the end of
+ * it, so that the stream can be used directly (to find its position, to
+ * patch the metadata or to flush it to disk). The queue stays open.
+ * 
+ * Prints an appropriate message to stderr and exits the program should an
+ * error have occurred writing.
+ */
+static void settle_output(struct FLVwriter *w)
+{
+    if( !w->ring )
+        return;
+    if( uring_drain(w->ring) != 0 || fseek(w->out, uring_offset(w->ring), SEEK_SET) != 0 )
+    {
+        fprintf(stderr, "ERROR while writing to output file %s: %s\n",
+                w->path, strerror(errno));
+        exit(1);
+    }
+    return;
+}
+
+/*
+ * close_output()
+ * 
+ * Closes the output stream of writer "w".
+ * 
+ * Prints an appropriate message to stderr and exits the program should an
+ * error occur during closing.
+ */
+static void close_output(struct FLVwriter *w)
+{
+    if( cache_neutral && w->seekable )
+        drop_output_cache(w, 1);
+    if( w->ring )
+    {
+        settle_output(w);
+        uring_close(w->ring);
+        w->ring = NULL;
+    }
+    if( sync_output && w->out != stdout &&
+        (fflush(w->out) != 0 || fsync(fileno(w->out)) != 0) )
+    {
+        fprintf(stderr, "ERROR while flushing output file %s to disk: %s\n",
+                w->path, strerror(errno));
+        exit(1);
+    }
+    if( w->temporary )
+        publish_output(w);
+    if( w->out != stdout && fclose(w->out) != 0 )
+    {
+        fprintf(stderr, "ERROR while closing output file %s: %s\n",
+                w->path, strerror(errno));
+        exit(1);
+    }
+    return;
+}
+
+/*
+ * finish_output()
+ * 
+ * Write the FLV header and metadata packet if no packets were written, work
+ * out the duration from the last timestamp and the duration of that packet,
+ * rewind to fill in the metadata, and close the output of writer "w" and of
+ * each destination teed from it. Metadata is only filled in where the
+ * output is a regular file.
+ */
+static void finish_output(struct FLVwriter *w)
+{
+    struct FLVwriter *t;
+
+    start_output(w); /* In case no packets were written */
+
+    if(!no_meta)
+    {
+        unsigned int duration;
+       
+        /* Rewind and write metadata */
+        if(!quiet)
+            fprintf(stderr, "Writing metadata...\n");
+
+        if(w->last_video_timestamp >= w->last_audio_timestamp)
+            duration = w->last_video_timestamp + frame_interval;
+        else
+            duration = w->last_audio_timestamp + (unsigned int)(0.5 + 1000.0 * w->last_packet_size * 8 / audio_bitrate);
+        duration -= w->chunk_start;
+
+        for( t = w; t; t = t->tee )
+            if( t->seekable && !t->omit_meta )
+            {
+                settle_output(t);
+                write_metadata(t->out, w->meta_offset, duration, &w->totals);
+            }
+    }
+
+    for( t = w; t; t = t->tee )
+    {
+        if( !quiet )
+            fprintf(stderr, "Closing output file %s\n", t->path);
+        close_output(t);
+    }
+
+    return;
+}
+
+/*
+ * extract_clips()
+ * 
+ * Read a list of clips from stdin, one per line as "inpoint outpoint
+ * filename" (points in seconds), and cut them all from the source file
+ * "source" in a single pass. Each tag of the source is read once and
+ * written to every clip whose in and out points contain it; each clip has
+ * its own writer, so its timestamps start from zero, its video starts at a
+ * keyframe (with the AVC sequence header in front of it) and its metadata
+ * describes the clip alone. As in append_file(), a clip starts at its first
+ * audio packet or video keyframe, and video before its first keyframe is
+ * dropped. Reading stops a little after the last out-point.
+ */
+static void extract_clips(const char *source)
+{
+    char buffer[2*MAX_NAME_LEN];
+    struct FLVclip *clips = NULL;
+    size_t count = 0, alloc = 0, i, pos, cache_dropped = 0;
+    unsigned int last_out = 0;
+    struct FLVmap map;
+    FILE *in;
+
+    while( fgets(buffer, sizeof(buffer), stdin) )
+    {
+        struct FLVclip *clip;
+        double mark_in, mark_out;
+        struct stat s;
+
+        if( count >= alloc )
+        {
+            alloc += 16;
+            clips = realloc(clips, alloc * sizeof(struct FLVclip));
+        }
+        clip = &clips[count];
+        init_writer(&clip->w);
+        if( sscanf(buffer, "%lf %lf %1023s", &mark_in, &mark_out, clip->w.path) != 3 )
+        {
+            if( strspn(buffer, " \t\r\n") != strlen(buffer) )
+                fprintf(stderr, "WARNING: Ignoring clip \"%s\"; expected inpoint, outpoint and filename\n",
+                        strtok(buffer, "\r\n"));
+            continue;
+        }
+        if( strcmp(clip->w.path, "-") == 0 )
+        {
+            fprintf(stderr, "ERROR: Clips can't be written to standard output.\n");
+            exit(1);
+        }
+        if( stat(clip->w.path, &s) == 0 )
+        {
+            fprintf(stderr,"ERROR: File %s exists; won't write header.\n", clip->w.path);
+            exit(1);
+        }
+        clip->mark_in = (unsigned int)(0.5 + mark_in*1000);
+        clip->mark_out = (unsigned int)(0.5 + mark_out*1000);
+        clip->start_timestamp = -999999;
+        clip->video_started = 0;
+        if( clip->mark_out > last_out )
+            last_out = clip->mark_out;
+        open_output(&clip->w, "wb");
+        count++;
+    }
+    if( count == 0 )
+    {
+        if( !quiet )
+            fprintf(stderr, "No clips given\n");
+        free(clips);
+        return;
+    }
+
+    if( !(in = fopen(source, "rb")) || map_stream(in, &map) != 0 )
+    {
+        fprintf(stderr, "ERROR while opening input file %s for reading: %s\n",
+                source, strerror(errno));
+        exit(1);
+    }
+    if( !quiet )
+        fprintf(stderr, "Cutting %d clips from \"%s\"\n", (int)count, source);
+
+    pos = scan_header(map.base, map.length);
+    if( force_audio_only || (pos > 0 && !(map.base[4] & 1) && (map.base[4] & 4)) ||
+        detect_audio_only(&map, pos) )
+    {
+        audio_only = 1;
+        if( !quiet && !force_audio_only )
+            fprintf(stderr, "%s: No video found; cutting audio only\n", source);
+    }
+
+    while( pos < map.length )
+    {
+        struct FLVpacket packet;
+        const unsigned char *tag;
+        char key_frame;
+
+        if( !scan_tag_valid(map.base, map.length, pos) )
+        {
+            /* Damaged tag; skip to the next one that looks sound */
+            size_t next = scan_resync(map.base, map.length, pos + 1);
+
+            if( !quiet && next < map.length )
+                fprintf(stderr, "WARNING: %s: bytes %lu to %lu are damaged; skipped\n",
+                        source, (unsigned long)pos, (unsigned long)next - 1);
+            else if( !quiet )
+                fprintf(stderr, "WARNING: %s: bytes %lu to end of file are damaged or truncated; skipped\n",
+                        source, (unsigned long)pos);
+            pos = next;
+            continue;
+        }
+
+        /* The payload is used where it lies in the mapped file */
+        tag = map.base + pos;
+        packet.type = tag[0];
+        packet.datasize = conv_ui24(&tag[1], 0);
+        packet.timestamp = conv_ui24(&tag[4], tag[7]);
+        packet.streamid = conv_ui24(&tag[8], 0);
+        packet.data = (unsigned char *)tag + 11;
+        packet.backptr = packet.datasize + 11;
+        packet.src = NULL;
+        pos += packet.datasize + 15;
+        if( pos > map.length )
+            break; /* Truncated last tag */
+        if( cache_neutral && pos - cache_dropped >= CACHE_WINDOW )
+            cache_dropped = drop_input_cache(in, &map, cache_dropped, pos);
+
+        if(packet.type == 18) /* Script data */
+        {
+            if(!metadata_extracted && !no_meta)
+            {
+                metadata_extracted = extract_metadata(&packet);
+                if(!quiet && metadata_extracted)
+                    fprintf(stderr, "Metadata successfully extracted.\n");
+            }
+            continue;
+        }
+        if(packet.type == 9 && packet.datasize >= 2 &&
+           (packet.data[0] & 0x0f) == 7 && packet.data[1] == 0) /* AVC sequence header */
+        {
+            if(!seq_header_pkt.data)
+                seq_header_pkt = packet;
+            continue;
+        }
+        if(packet.type != 8 && (packet.type != 9 || audio_only))
+            continue;
+        if(packet.timestamp >= last_out + CLIP_SLACK_MS)
+            break;
+
+        key_frame = packet.type == 8 || (packet.datasize >= 1 && (packet.data[0] & 0xf0) >> 4 == 1);
+        for( i = 0; i < count; i++ )
+        {
+            struct FLVclip *clip = &clips[i];
+            struct FLVpacket copy = packet;
+
+            if(packet.timestamp < clip->mark_in || packet.timestamp >= clip->mark_out)
+                continue;
+            if(packet.type == 9 && !clip->video_started)
+            {
+                /* Discard video received before the first keyframe */
+                if(!key_frame)
+                    continue;
+                clip->video_started = 1;
+            }
+            if(clip->start_timestamp == -999999)
+            {
+                clip->start_timestamp = -(long)packet.timestamp;
+                clip->w.first_time = 0;
+                if(!quiet)
+                    fprintf(stderr, "%s: Clip start timestamp set to %ld (First %s %d)\n",
+                            clip->w.path, clip->start_timestamp,
+                            packet.type == 8 ? "audio packet" : "video keyframe", packet.timestamp);
+            }
+            write_packet(&clip->w, &copy, clip->start_timestamp);
+        }
+    }
+
+    for( i = 0; i < count; i++ )
+        finish_output(&clips[i].w);
+    /* The sequence header lies in the mapped file */
+    memset(&seq_header_pkt, 0, sizeof(seq_header_pkt));
+    unmap_file(&map);
+    if( cache_neutral )
+        posix_fadvise(fileno(in), 0, 0, POSIX_FADV_DONTNEED);
+    fclose(in);
+    free(clips);
+
+    return;
+}
+
+/*
+ * is_split_point()
+ * 
+ * Returns 1 if split output may start a new chunk with the packet "packet":
+ * a video keyframe other than an AVC sequence header, or in audio-only
+ * output any audio packet other than an AAC sequence header. Otherwise 0.
+ */
+static int is_split_point(const struct FLVpacket *packet)
+{
+    if( packet->datasize < 2 || !packet->data )
+        return 0;
+    if( audio_only )
+        return packet->type == 8 &&
+               !((packet->data[0] & 0xf0) >> 4 == 10 && packet->data[1] == 0);
+    return packet->type == 9 && (packet->data[0] & 0xf0) >> 4 == 1 &&
+           !((packet->data[0] & 0x0f) == 7 && packet->data[1] == 0);
+}
+
+/*
+ * next_chunk()
+ * 
+ * Finish the current chunk of split output and start the next one, whose
+ * timestamps count from "start". The timestamps of the last packets
+ * written are kept, so the input carries on seamlessly, but the totals
+ * start again. The new chunk gets its own header and metadata packet, and
+ * the AAC sequence header if there is one; write_packet() puts the AVC
+ * sequence header before its first video packet.
+ */
+static void next_chunk(struct FLVwriter *w, long start)
+{
+    struct FLVtotals empty = { 0, 0, 0, 0, 0, 0, 0, -1, -1 };
+    struct stat s;
+
+    finish_output(w);
+
+    w->chunk++;
+    chunk_name(w);
+    if( stat(w->path, &s) == 0 )
+    {
+        fprintf(stderr,"ERROR: File %s exists; won't write header.\n", w->path);
+        exit(1);
+    }
+    open_output(w, "wb");
+    w->started = 0;
+    w->seq_header_written = 0;
+    w->meta_offset = -1;
+    w->totals = empty;
+    w->chunk_start = start;
+
+    start_output(w);
+    if( aac_header_pkt.data )
+    {
+        write_tag(w, &aac_header_pkt, 0);
+        w->totals.audio_size += aac_header_pkt.datasize + 15;
+        w->totals.audio_bytes += aac_header_pkt.datasize;
+        w->totals.data_size += aac_header_pkt.datasize + 15;
+    }
+
+    return;
+}
+
+/*
+ * keep_aac_header()
+ * 
+ * Keep a copy of the AAC sequence header "packet" so that it can be
+ * repeated at the start of each chunk of split output.
+ */
+static void keep_aac_header(const struct FLVpacket *packet)
+{
+    if( aac_header_pkt.data )
+    {
+        if( aac_header_pkt.datasize == packet->datasize &&
+            memcmp(aac_header_pkt.data, packet->data, packet->datasize) == 0 )
+            return;
+        free(aac_header_pkt.data);
+        mem_release(aac_header_pkt.datasize);
+        aac_header_pkt.data = NULL;
+    }
+    if( !mem_reserve(packet->datasize) )
+    {
+        if( !quiet )
+            fprintf(stderr, "WARNING: AAC sequence header of %d bytes exceeds memory budget; ignored\n",
+                    packet->datasize);
+        return;
+    }
+    aac_header_pkt = *packet;
+    aac_header_pkt.data = malloc(packet->datasize);
+    memcpy(aac_header_pkt.data, packet->data, packet->datasize);
+
+    return;
+}
+
+/*
+ * chunk_name()
+ * 
+ * Set the path of writer "w" to the name of its current chunk, made by
+ * substituting the chunk number into split_pattern.
+ */
+static void chunk_name(struct FLVwriter *w)
+{
+    snprintf(w->path, sizeof(w->path), split_pattern, w->chunk);
+    return;
+}
+
+/*
+ * check_pattern()
+ * 
+ * Returns 1 if "pattern" is safe to use as the printf format naming the
+ * chunks of split output: it must hold exactly one conversion, a %d with
+ * at most a zero flag and a width (e.g. %03d), and any other per cent
+ * signs must be doubled. Otherwise 0.
+ */
+static int check_pattern(const char *pattern)
+{
+    int conversions = 0;
+
+    for( ; *pattern; pattern++ )
+    {
+        if( *pattern != '%' )
+            continue;
+        if( *++pattern == '%' )
+            continue;
+        pattern += strspn(pattern, "0123456789");
+        if( *pattern != 'd' )
+            return 0;
+        conversions++;
+    }
+
+    return conversions == 1;
+}
+
+/*
+ * write_checkpoint()
+ * 
+ * If a checkpoint file was given with -k and at least CHECKPOINT_BYTES have
+ * been written since the last checkpoint, save how far the join has got:
+ * the input list line being read, "in_pos", the offset of the next tag to
+ * read from it (0 to start it afresh), the "file_start_timestamp" used for
+ * it and the state of writer "w". The output is flushed to disk first, so
+ * that everything the checkpoint describes is there, and the checkpoint is
+ * written to a temporary file that is then renamed over the old one, so
+ * there is always a complete checkpoint to resume from. Failure to save a
+ * checkpoint isn't fatal.
+ */
+static void write_checkpoint(struct FLVwriter *w, size_t in_pos, long file_start_timestamp)
+{
+    char tmp_path[MAX_NAME_LEN + 8];
+    FILE *fd;
+    long output_offset;
+
+    if( !checkpoint_path || w->totals.data_size - checkpoint_size < CHECKPOINT_BYTES )
+        return;
+    checkpoint_size = w->totals.data_size;
+    settle_output(w);
+
+    if( fflush(w->out) != 0 || fdatasync(fileno(w->out)) != 0 ||
+        (output_offset = ftell(w->out)) == -1 )
+    {
+        fprintf(stderr, "WARNING: Unable to flush output file %s for checkpoint: %s\n",
+                w->path, strerror(errno));
+        return;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", checkpoint_path);
+    if( !(fd = fopen(tmp_path, "w")) )
+    {
+        fprintf(stderr, "WARNING: Unable to create checkpoint file %s: %s\n",
+                tmp_path, strerror(errno));
+        return;
+    }
+    fprintf(fd, "%s checkpoint\n", PROG_NAME);
+    fprintf(fd, "input %lu\ninput_offset %ld\nfile_start_timestamp %ld\noutput_offset %ld\n",
+            input_number, (long)in_pos, file_start_timestamp, output_offset);
+    fprintf(fd, "last_video_timestamp %u\nlast_audio_timestamp %ld\nlast_packet_size %u\n",
+            w->last_video_timestamp, w->last_audio_timestamp, w->last_packet_size);
+    fprintf(fd, "last_audio_size %u\nlast_audio_interval %ld\nseq_header_written %d\nfirst_time %d\n",
+            w->last_audio_size, w->last_audio_interval, w->seq_header_written, w->first_time);
+    fprintf(fd, "video_tags %lu\naudio_tags %lu\nvideo_bytes %llu\naudio_bytes %llu\n",
+            w->totals.video_tags, w->totals.audio_tags, w->totals.video_bytes, w->totals.audio_bytes);
+    fprintf(fd, "video_size %llu\naudio_size %llu\ndata_size %llu\n",
+            w->totals.video_size, w->totals.audio_size, w->totals.data_size);
+    fprintf(fd, "last_timestamp %ld\nlast_keyframe_timestamp %ld\n",
+            w->totals.last_timestamp, w->totals.last_keyframe_timestamp);
+
+    if( fflush(fd) != 0 || fsync(fileno(fd)) != 0 || fclose(fd) != 0 ||
+        rename(tmp_path, checkpoint_path) != 0 )
+        fprintf(stderr, "WARNING: Unable to save checkpoint file %s: %s\n",
+                checkpoint_path, strerror(errno));
+    else if( !quiet )
+        fprintf(stderr, "Checkpoint: input %lu, output %ld bytes\n", input_number, output_offset);
+
+    return;
+}
+
+/*
+ * resume_output()
+ * 
+ * Read the checkpoint file into resume_point, cut the output file of writer
+ * "w" back to the length it had at the checkpoint and prepare to carry on
+ * from there: the output is examined as for appending to it (see
+ * recover_output()), then the timestamps and totals are restored from the
+ * checkpoint. The input metadata is extracted again as the inputs already
+ * joined are skipped over (see prescan_file()).
+ * 
+ * Prints an appropriate message to stderr and exits the program if the
+ * checkpoint can't be read or doesn't match the output file.
+ */
+static void resume_output(struct FLVwriter *w)
+{
+    struct FLVcheckpoint *c = &resume_point;
+    int seq_header_written, first_time;
+    FILE *fd;
+    struct stat s;
+
+    if( !(fd = fopen(checkpoint_path, "r")) )
+    {
+        fprintf(stderr, "ERROR while opening checkpoint file %s: %s\n",
+                checkpoint_path, strerror(errno));
+        exit(1);
+    }
+    if( fscanf(fd, PROG_NAME " checkpoint input %lu input_offset %ld file_start_timestamp %ld output_offset %ld "
+                   "last_video_timestamp %u last_audio_timestamp %ld last_packet_size %u "
+                   "last_audio_size %u last_audio_interval %ld seq_header_written %d first_time %d "
+                   "video_tags %lu audio_tags %lu video_bytes %llu audio_bytes %llu "
+                   "video_size %llu audio_size %llu data_size %llu "
+                   "last_timestamp %ld last_keyframe_timestamp %ld",
+               &c->input, &c->input_offset, &c->file_start_timestamp, &c->output_offset,
+               &c->last_video_timestamp, &c->last_audio_timestamp, &c->last_packet_size,
+               &c->last_audio_size, &c->last_audio_interval, &c->seq_header_written, &c->first_time,
+               &c->totals.video_tags, &c->totals.audio_tags, &c->totals.video_bytes, &c->totals.audio_bytes,
+               &c->totals.video_size, &c->totals.audio_size, &c->totals.data_size,
+               &c->totals.last_timestamp, &c->totals.last_keyframe_timestamp) != 20 )
+    {
+        fprintf(stderr, "ERROR: %s is not a valid checkpoint file\n", checkpoint_path);
+        exit(1);
+    }
+    fclose(fd);
+
+    if( stat(w->path, &s) != 0 || s.st_size < c->output_offset )
+    {
+        fprintf(stderr, "ERROR: Output file %s is missing or shorter than at the checkpoint\n", w->path);
+        exit(1);
+    }
+    open_output(w, "r+b");
+    if( ftruncate(fileno(w->out), c->output_offset) != 0 )
+    {
+        fprintf(stderr, "ERROR while truncating output file %s: %s\n",
+                w->path, strerror(errno));
+        exit(1);
+    }
+
+    seq_header_written = c->seq_header_written;
+    first_time = c->first_time;
+    recover_output(w);
+    w->last_video_timestamp = c->last_video_timestamp;
+    w->last_audio_timestamp = c->last_audio_timestamp;
+    w->last_packet_size = c->last_packet_size;
+    w->last_audio_size = c->last_audio_size;
+    w->last_audio_interval = c->last_audio_interval;
+    w->seq_header_written = seq_header_written;
+    w->first_time = first_time;
+    w->totals = c->totals;
+    /* The metadata packet only holds placeholders so far */
+    metadata_extracted = 0;
+
+    if( !quiet )
+        fprintf(stderr, "Resuming at line %lu of the input list\n", c->input + 1);
+
+    return;
+}
+
+/*
+ * prescan_file()
+ * 
+ * Take the metadata and AVC sequence header from the first few tags of the
+ * input file "filename", if they haven't been found yet, without joining
+ * it. Used for the inputs that had been joined before a resumed join was
+ * interrupted.
+ */
+static void prescan_file(const char *filename)
+{
+    struct FLVmap map;
+    struct FLVscan scan;
+    size_t i;
+
+    if( (metadata_extracted || no_meta) && seq_header_pkt.data )
+        return;
+    if( map_file(filename, &map) != 0 )
+    {
+        fprintf(stderr, "ERROR while opening input file %s for reading: %s\n",
+                filename, strerror(errno));
+        return;
+    }
+
+    memset(&scan, 0, sizeof(scan));
+    scan_tags(map.base, map.length, scan_header(map.base, map.length), &scan, AUDIO_DETECT_TAGS);
+    for( i = 0; i < scan.count; i++ )
+    {
+        struct FLVpacket packet;
+
+        memset(&packet, 0, sizeof(packet));
+        packet.type = scan.types[i];
+        packet.datasize = scan.sizes[i];
+        packet.data = (unsigned char *)map.base + scan.offsets[i] + 11;
+        packet.backptr = packet.datasize + 11;
+        if( packet.type == 18 && !metadata_extracted && !no_meta )
+            metadata_extracted = extract_metadata(&packet);
+        else if( packet.type == 9 && packet.datasize >= 2 && !seq_header_pkt.data &&
+                 (packet.data[0] & 0x0f) == 7 && packet.data[1] == 0 &&
+                 mem_reserve(packet.datasize) )
+        {
+            seq_header_pkt = packet;
+            seq_header_pkt.data = malloc(packet.datasize);
+            memcpy(seq_header_pkt.data, packet.data, packet.datasize);
+        }
+    }
+    scan_free(&scan);
+    unmap_file(&map);
+
+    return;
+}
+
+/*
+ * drop_input_cache()
+ * 
+ * Drop bytes "from" to "to" of the input file "in" (also mapped as "map",
+ * unless its length is 0) from the page cache, as they won't be read again.
+ * Our own mapping of those pages is discarded first, as the kernel keeps
+ * mapped pages in the cache. Only whole pages are dropped.
+ * 
+ * Returns the offset up to which the input has now been dropped.
+ */
+static size_t drop_input_cache(FILE *in, const struct FLVmap *map, size_t from, size_t to)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    from -= from % page;
+    to -= to % page;
+    if( to <= from )
+        return from;
+    if( map->length > 0 && map->mapped )
+        madvise((void *)(map->base + from), to - from, MADV_DONTNEED);
+    posix_fadvise(fileno(in), (off_t)from, (off_t)(to - from), POSIX_FADV_DONTNEED);
+
+    return to;
+}
+
+/*
+ * drop_output_cache()
+ * 
+ * Keep the output of writer "w" from filling the page cache. Writeback of
+ * everything written since the last call is started, and the output that
+ * was started at the last call (and so has had time to reach the disk) is
+ * waited for and dropped from the cache. Dirty pages therefore never pile
+ * up beyond two windows, and the writes themselves stay asynchronous. If
+ * "final" is non-zero the whole file is written back and dropped, as when
+ * closing it.
+ */
+static void drop_output_cache(struct FLVwriter *w, int final)
+{
+    int fd = fileno(w->out);
+    long end;
+
+    /* Only data already in the file can be written back. With io_uring that
+     * is what has completed; waiting for the rest would stall the queue. */
+    if( w->ring && !final )
+        end = uring_completed(w->ring);
+    else
+    {
+        settle_output(w);
+        if( fflush(w->out) != 0 || (end = ftell(w->out)) == -1 )
+            return;
+    }
+    w->cache_pending = 0;
+
+    if( final )
+    {
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                  SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+        fdatasync(fd);
+#endif
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        return;
+    }
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    if( end > w->cache_started )
+        sync_file_range(fd, w->cache_started, end - w->cache_started, SYNC_FILE_RANGE_WRITE);
+    if( w->cache_started > w->cache_dropped )
+    {
+        sync_file_range(fd, w->cache_dropped, w->cache_started - w->cache_dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, w->cache_dropped, w->cache_started - w->cache_dropped, POSIX_FADV_DONTNEED);
+        w->cache_dropped = w->cache_started;
+    }
+#else
+    /* Writeback can't be started early here; wait for it all */
+    fdatasync(fd);
+    posix_fadvise(fd, w->cache_dropped, end - w->cache_dropped, POSIX_FADV_DONTNEED);
+    w->cache_dropped = end;
+#endif
+    w->cache_started = end;
+
+    return;
+}
@@ -7,12 +7,108 @@ struct FLVpacket
    unsigned int datasize, timestamp, streamid;
    unsigned char *data;
    unsigned int backptr;
+   /* If src is non-NULL the payload is not held in memory: it must be copied
+    * from byte offset "offset" of stream "src", and data holds at most the
+    * first PAYLOAD_HEAD bytes of it */
+   FILE *src;
+   long offset;
+};
+
+/* Number of payload bytes always kept in memory for inspecting frame types */
+#define PAYLOAD_HEAD 16
+
+/* Running totals of what has been written to the output */
+struct FLVtotals
+{
+   unsigned long video_tags, audio_tags;
+   unsigned long long video_bytes, audio_bytes; /* payload bytes */
+   unsigned long long video_size, audio_size;   /* whole tags, including headers */
+   unsigned long long data_size;                /* all tags written */
+   long last_timestamp, last_keyframe_timestamp; /* -1 if none */
+};
+
+struct FLVuring;
+
+/* Maximum length of input and output filenames */
+#define MAX_NAME_LEN 1024
+
+/* One output file and the state of what has been written to it */
+struct FLVwriter
+{
+   char path[MAX_NAME_LEN];
+   FILE *out;
+   char started;            /* FLV header and metadata packet written */
+   char seq_header_written;
+   char first_time;         /* No input file has set a start timestamp yet */
+   long meta_offset;        /* File offset of the metadata packet payload */
+   unsigned int last_video_timestamp;
+   long last_audio_timestamp; /* -1 if none */
+   unsigned int last_packet_size, last_audio_size;
+   long last_audio_interval;
+   struct FLVtotals totals;
+   /* When the output is split into chunks: the number of the current chunk
+    * and the timestamp it starts at (timestamps in it count from there) */
+   int chunk;
+   long chunk_start;
+   /* Further destinations given the same data (-o given several times); of
+    * these writers only the path, stream and flags are used */
+   struct FLVwriter *tee;
+   char seekable;           /* Metadata can be filled in at the end */
+   char omit_meta;          /* No metadata packet is written to this one */
+   char writing_meta;       /* The metadata packet is being written */
+   /* Atomic output (-t) is written to a temporary file, unnamed or with the
+    * hidden name tmp_path, and only given its real name once complete */
+   char temporary;
+   char tmp_path[MAX_NAME_LEN + 16];
+   /* Queue the output is written through with io_uring (-i), or NULL;
+    * with stdio_only set it is written with stdio all the same */
+   struct FLVuring *ring;
+   char stdio_only;
+   /* Cache-neutral mode (-p): output written since the last drop from the
+    * page cache, and the offsets writeback was started from and the output
+    * was dropped up to */
+   size_t cache_pending;
+   long cache_started, cache_dropped;
+};
+
+/* How far a join had got, saved periodically so that it can be resumed */
+struct FLVcheckpoint
+{
+   unsigned long input;        /* Line of the input list being read */
+   long input_offset;          /* Next tag to read from it (0 = its start) */
+   long file_start_timestamp;  /* Offset added to its timestamps */
+   long output_offset;         /* Length of the output */
+   unsigned int last_video_timestamp;
+   long last_audio_timestamp;
+   unsigned int last_packet_size, last_audio_size;
+   long last_audio_interval;
+   int seq_header_written, first_time;
+   struct FLVtotals totals;
+};
+
+/* One clip cut from a source file, with its in and out points in ms */
+struct FLVclip
+{
+   unsigned int mark_in, mark_out;
+   long start_timestamp;    /* -999999 until the first packet is written */
+   char video_started;      /* A video keyframe has been written */
+   struct FLVwriter w;
 };
 
 
 /* metadata.c */
-struct FLVpacket *generate_metadata_packet(FILE *);
+struct FLVpacket *generate_metadata_packet(void);
 int extract_metadata(struct FLVpacket *);
-void write_metadata(FILE *, unsigned int);
+int locate_metadata(struct FLVpacket *, struct FLVtotals *);
+void write_metadata(FILE *, long, unsigned int, const struct FLVtotals *);
+
+/* flvuring.c */
+size_t uring_setup(size_t);
+struct FLVuring *uring_open(int, long);
+int uring_write(struct FLVuring *, const unsigned char *, size_t);
+int uring_drain(struct FLVuring *);
+long uring_offset(const struct FLVuring *);
+long uring_completed(struct FLVuring *);
+void uring_close(struct FLVuring *);
 
 #include "data_conv.h"
@@ -21,170 +21,253 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <math.h>
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "data_conv.h"
+#include "flvscan.h"
 
-unsigned char *parse_script_object(unsigned char *);
-unsigned char *parse_script_variable(unsigned char*);
-unsigned char *parse_script_string(unsigned char *, unsigned int);
+/* Size of the buffer output is collected in before being written to stdout */
+#define OUTBUFF_SIZE 65536
 
-static void parse_file(FILE *infile)
+/* Output formats for list_tags() */
+#define LIST_INDEX 0
+#define LIST_JSON  1
+#define LIST_CSV   2
+
+/* Maximum nesting of script data objects decoded as JSON */
+#define MAX_AMF_DEPTH 32
+
+static char outbuff[OUTBUFF_SIZE];
+static size_t outlen;
+
+static const unsigned char *parse_script_object(const unsigned char *, const unsigned char *, int);
+static const unsigned char *parse_script_variable(const unsigned char *, const unsigned char *, int);
+static const unsigned char *parse_script_string(const unsigned char *, const unsigned char *, int);
+static void list_tags(const struct FLVmap *, int);
+static void print_metadata_json(const struct FLVmap *);
+static const char *tag_type_name(unsigned char);
+static void json_script_data(const unsigned char *, size_t);
+static const unsigned char *json_amf_value(const unsigned char *, const unsigned char *, int);
+static const unsigned char *json_amf_properties(const unsigned char *, const unsigned char *, int);
+static void json_string(const unsigned char *, size_t);
+static void json_number(double);
+static void print_stats(const char *, const struct FLVstats *);
+static void print_stream_stats(const char *, const struct FLVstream_stats *, double);
+static void print_histogram(const char *, const unsigned long *, const unsigned long *, int);
+static void print_audit(const struct FLVaudit_job *, size_t);
+static int print_check(const char *, const struct FLVcheck *);
+static int print_check_audit(const struct FLVaudit_job *, size_t);
+
+static void out_flush(void);
+static void out_write(const char *, size_t);
+static void out_str(const char *);
+static void out_uint(unsigned long);
+static void out_printf(const char *, ...);
+
+/*
+ * parse_file()
+ * 
+ * Walk through the tags in the mapped file "map", printing a description of
+ * the file header, each tag header and the contents of any script tags.
+ * Tags are read in place from the mapping and all output is collected in
+ * one large buffer.
+ */
+static void parse_file(const struct FLVmap *map)
 {
-    size_t buffsize = 1024, size;
-    unsigned char *buff = malloc(buffsize);
+    const unsigned char *base = map->base;
+    size_t length = map->length, offset;
 
+    if( length < 9 )
     {
-        /* Look for the header at the start of the file */
-        int header_length = 9, i;
+        fprintf(stderr, "File too short to contain an FLV header\n");
+        return;
+    }
 
-        size = fread( buff, 1, header_length, infile );
+    {
+        /* Look for the header at the start of the file */
+        size_t header_length = conv_ui32(&base[5]);
 
-        for (i = 0; i <  3; i++) /* Print 3 signature bytes */
-            putchar(buff[i]);
+        out_write((const char *)base, 3); /* Print 3 signature bytes */
 
-        printf("v.");
-        printf("%d",buff[3]); /* FLV version */
+        out_str("v.");
+        out_uint(base[3]); /* FLV version */
 
-        printf("\nAudio present: %s", (buff[4] & 4)? "Yes" : "No");
-        printf("\nVideo present: %s", (buff[4] & 1)? "Yes" : "No");
+        out_str("\nAudio present: ");
+        out_str((base[4] & 4)? "Yes" : "No");
+        out_str("\nVideo present: ");
+        out_str((base[4] & 1)? "Yes" : "No");
 
-        header_length -= conv_ui32(&buff[5]);
-        printf("\nExtra Header length: %d bytes\n", header_length );
+        if( header_length < 9 || header_length > length )
+            header_length = 9;
+        out_printf("\nExtra Header length: %d bytes\n", (int)(header_length - 9));
 
         /* Skip over any extra header bytes if present */
-        fseek( infile, header_length, SEEK_CUR );
-        printf("----End of Header----\n");
+        offset = header_length;
+        out_str("----End of Header----\n");
     }
    
     while(1)
     {
-        unsigned int prev_tag_length;
-       
         /* Read back-pointer and exit if there's nothing after it */
-        size = fread( buff, 1, 4, infile );
-        prev_tag_length = conv_ui32(buff);
-       
-        printf("Prev. tag length: %d bytes\n", prev_tag_length);
+        if( offset + 4 > length )
+        {
+            out_flush();
+            fprintf(stderr,"EOF before back pointer; exiting.\n");
+            break;
+        }       
+        out_str("Prev. tag length: ");
+        out_uint(conv_ui32(base + offset));
+        out_str(" bytes\n");
+        offset += 4;
        
-        if( feof(infile) )
+        if( offset == length )
         {
+            out_flush();
             fprintf(stderr,"EOF after back pointer; exiting.\n");
             break;
         }       
+        if( offset + 11 > length )
+        {
+            out_printf("WARNING: %d bytes of incomplete tag header at end of file\n",
+                       (int)(length - offset));
+            break;
+        }
        
         /* Read the tag header */
         {   
-            unsigned char tag_type;
-            unsigned int datasize, timestamp;
-           
-            size = fread( buff, 1, 11, infile );
-           
-            tag_type = buff[0];
-            datasize = conv_ui24(&buff[1], 0);
-            timestamp = conv_ui24(&buff[4], buff[7]);
+            const unsigned char *tag = base + offset;
+            const unsigned char *payload = tag + 11;
+            unsigned char tag_type = tag[0];
+            unsigned int datasize = conv_ui24(&tag[1], 0);
+            unsigned int timestamp = conv_ui24(&tag[4], tag[7]);
 
             switch(tag_type)
             {
                 case 8:
-                    printf( "Audio Tag, ");
+                    out_str("Audio Tag, ");
                     break;
                 case 9:
-                    printf( "Video Tag, ");
+                    out_str("Video Tag, ");
                     break;
                 case 18:
-                    printf( "Script Tag, ");
+                    out_str("Script Tag, ");
                     break;
                 default:
-                    printf( "Undefined Tag (Type %d), ", tag_type);
+                    out_printf("Undefined Tag (Type %d), ", tag_type);
                     break;
             }
-            printf( "%d bytes. Timestamp %dms.\n", datasize, timestamp);
+            out_uint(datasize);
+            out_str(" bytes. Timestamp ");
+            out_uint(timestamp);
+            out_str("ms.\n");
+
+            offset += 11;
+            if( datasize > length - offset )
+            {
+                out_printf("WARNING: Tag truncated; only %d of %d bytes present\n",
+                           (int)(length - offset), datasize);
+                break;
+            }
 
             if( tag_type == 18 )
             {
-                /* Read and parse script tag data */
-                unsigned char object_end[] = { 2, 0, 0, 9 };
-                unsigned char *pos;
-               
-                if( datasize > buffsize )
-                    buff = realloc( buff, datasize );
-                fread( buff, 1, datasize, infile );
-
-                pos = buff;
-                do {
-                    pos = parse_script_object(pos);
-
-                    if( memcmp(pos, object_end, 4) != 0 )
-                        printf( "WARNING: Script Object closing bytes missing.\n");
+                /* Parse script tag data, reading no further than its end */
+                const unsigned char *pos = payload, *end = payload + datasize;
+                static const unsigned char object_end[] = { 2, 0, 0, 9 };
+
+                while( pos < end )
+                {
+                    if( !(pos = parse_script_object(pos, end, 0)) )
+                    {
+                        out_str("WARNING: Script data truncated or malformed.\n");
+                        break;
+                    }
+
+                    if( end - pos < 4 || memcmp(pos, object_end, 4) != 0 )
+                        out_str("WARNING: Script Object closing bytes missing.\n");
                     else
                         /* Skip over closing bytes if present */
                         pos += 4;
 
-                    printf("--Script Object End\n");
-                } while( (pos - buff) < datasize );
+                    out_str("--Script Object End\n");
+                }
             }
-            else if( tag_type == 9 )
+            else if( tag_type == 9 && datasize >= 2 )
             {
                 /* Check for H.264/AVC special packets and report if present */
-                fread(buff, 1, 2, infile);
+                if((payload[0] & 0xf0) >> 4 == 1) /* frame type */
+                    out_str("Keyframe");
 
-                if((buff[0] & 0xf0) >> 4 == 1) /* frame type */
-                    printf("Keyframe");
-
-                if((buff[0] & 0x0f) == 7) /* codec ID */
+                if((payload[0] & 0x0f) == 7) /* codec ID */
                 {
                     /* AVC video packet */
-                    switch(buff[1])
+                    switch(payload[1])
                     {
                          case 0:
-                             printf("  AVC sequence header");
+                             out_str("  AVC sequence header");
                              break;
                          case 1:
-                             printf("  AVC NAL unit");
+                             out_str("  AVC NAL unit");
                              break;
                          case 2:
-                             printf("  AVC end of sequence");
+                             out_str("  AVC end of sequence");
                              break;
                          default:
-                             printf("  Unrecognised AVC packet type!");
+                             out_str("  Unrecognised AVC packet type!");
                              break;
                     }
                 }
 
-                putchar('\n');
-                fseek(infile, datasize-2, SEEK_CUR);
+                out_write("\n", 1);
             }
-            else
-                /* Skip over payload */
-                fseek( infile, datasize, SEEK_CUR );
+
+            /* Skip over payload */
+            offset += datasize;
         }       
 
     }
 
+    out_flush();
     return;
 }
 
-unsigned char *parse_script_object(unsigned char *pos)
+/*
+ * parse_script_object()
+ * 
+ * Print the script data object (name and value) starting at "pos" and
+ * ending no later than "end", "depth" levels deep in nested objects.
+ * 
+ * Returns a pointer to the byte following the object, or NULL if the data
+ * is truncated, malformed or nested more than MAX_AMF_DEPTH levels deep.
+ */
+static const unsigned char *parse_script_object(const unsigned char *pos, const unsigned char *end, int depth)
 {
-    unsigned char marker = *(pos++);
-    unsigned char variable_end[] = { 0, 0, 9 };
+    static const unsigned char variable_end[] = { 0, 0, 9 };
+
+    if( pos >= end || depth > MAX_AMF_DEPTH )
+        return NULL;
 
-    printf("--Script Object Start\n");
+    out_printf("--Script Object Start\n");
    
-    if( marker != 2 )
-    {
-        printf( "WARNING: Script Object Marker Byte missing.\n");
-        pos--;
-    }   
+    if( *pos != 2 )
+        out_printf( "WARNING: Script Object Marker Byte missing.\n");
+    else
+        pos++;
 
-    printf( "Object Name: ");
-    pos = parse_script_string(pos + 2, conv_ui16(pos));
-    printf( "\tType: ");    
-    pos = parse_script_variable(pos);
+    out_printf( "Object Name: ");
+    if( !(pos = parse_script_string(pos, end, 2)) )
+        return NULL;
+    out_printf( "\tType: ");    
+    if( !(pos = parse_script_variable(pos, end, depth)) )
+        return NULL;
 
-    if( memcmp(pos, variable_end, 3) != 0 )
-        printf( "WARNING: Script variable closing bytes missing.\n");
+    if( end - pos < 3 || memcmp(pos, variable_end, 3) != 0 )
+        out_printf( "WARNING: Script variable closing bytes missing.\n");
     else
         /* Skip over closing bytes if present */
         pos += 3;
@@ -192,133 +275,1045 @@ unsigned char *parse_script_object(unsigned char *pos)
     return pos;
 }
 
-unsigned char *parse_script_variable(unsigned char *pos)
+/*
+ * parse_script_variable()
+ * 
+ * Print the type and value of the script data value starting at "pos" and
+ * ending no later than "end", "depth" levels deep in nested objects.
+ * 
+ * Returns a pointer to the byte following the value, or NULL if the data is
+ * truncated, malformed or nested too deeply.
+ */
+static const unsigned char *parse_script_variable(const unsigned char *pos, const unsigned char *end, int depth)
 {
-    unsigned char variable_type = *(pos++);
+    unsigned char variable_type;
+
+    if( pos >= end )
+        return NULL;
+    variable_type = *(pos++);
    
     switch( variable_type )
     {
         case 0:
-            printf("Number\tValue: %.2f\n", conv_double(pos));       
+            if( end - pos < 8 )
+                return NULL;
+            out_printf("Number\tValue: %.2f\n", conv_double(pos));       
             pos += sizeof(double);
             break;
         case 1:
-            printf("Boolean\tValue: %d\n", *pos);
+            if( end - pos < 1 )
+                return NULL;
+            out_printf("Boolean\tValue: %d\n", *pos);
             pos++;
             break;
         case 2:
-            printf("String\tValue: ");
-            pos = parse_script_string(pos + 2, conv_ui16(pos));
-            printf("\n");
+            out_printf("String\tValue: ");
+            pos = parse_script_string(pos, end, 2);
+            out_printf("\n");
             break;
         case 3:
-            printf("Object\n");
-            pos = parse_script_object(pos);
+            out_printf("Object\n");
+            pos = parse_script_object(pos, end, depth + 1);
             break;
         case 4:
-            printf("MovieClip\n");
+            out_printf("MovieClip\n");
             break;
         case 5:
-            printf("Null\n");
+            out_printf("Null\n");
             break;
         case 6:
-            printf("Undefined\n");
+            out_printf("Undefined\n");
             break;
         case 7:
-            printf("Reference\tValue: %d\n", conv_ui16(pos));
+            if( end - pos < 2 )
+                return NULL;
+            out_printf("Reference\tValue: %d\n", conv_ui16(pos));
             pos += 2;
             break;
         case 8:
-            printf("ECMA Array\t");
+            out_printf("ECMA Array\t");
             {
-                int array_length = conv_ui32(pos);
-                int count;
+                int array_length, count;
 
+                if( end - pos < 4 )
+                    return NULL;
+                array_length = conv_ui32(pos);
                 pos += 4;
-                printf("Length: %d variables\n", array_length);
+                out_printf("Length: %d variables\n", array_length);
 
-                for( count = 0; count < array_length; count++ )
+                /* The count comes from the file; stop at the end of the data */
+                for( count = 0; count < array_length && pos; count++ )
                 {
-                    printf( "Variable %d\tName: ", count);
-                    pos = parse_script_string(pos + 2, conv_ui16(pos));
-                    printf( "\tType: ");    
-                    pos = parse_script_variable(pos);
+                    out_printf( "Variable %d\tName: ", count);
+                    if( (pos = parse_script_string(pos, end, 2)) )
+                    {
+                        out_printf( "\tType: ");    
+                        pos = parse_script_variable(pos, end, depth + 1);
+                    }
                 }
             }
             break;
         case 10:
-            printf("Script Array\t");
+            out_printf("Script Array\t");
             {
-                int array_length = conv_ui32(pos);
-                int count;
+                int array_length, count;
 
+                if( end - pos < 4 )
+                    return NULL;
+                array_length = conv_ui32(pos);
                 pos += 4;
-                printf("Length: %d variables\n", array_length);
+                out_printf("Length: %d variables\n", array_length);
 
-                for( count = 0; count < array_length; count++ )
+                for( count = 0; count < array_length && pos; count++ )
                 {
-                    printf( "Variable %d\tType: ", count);
-                    pos = parse_script_variable(pos);
+                    out_printf( "Variable %d\tType: ", count);
+                    pos = parse_script_variable(pos, end, depth + 1);
                 }
             }
             break;
         case 11:
-            printf("Date\t");
+            out_printf("Date\t");
             {
-                time_t timestamp = conv_double(pos) / 1000; /* value is millisecs since epoch */
+                double millisecs;
+                time_t timestamp;
+                struct tm *date;
+                const char *text = NULL;
                 short tz_offset;
 
+                if( end - pos < 10 )
+                    return NULL;
+                millisecs = conv_double(pos); /* value is millisecs since epoch */
                 pos += sizeof(double);
                 tz_offset = conv_si16(pos);
                 pos +=2;
 
-                printf("Value: %s\tTimezone: %+g\n", asctime(gmtime(&timestamp)),
+                /* Out-of-range dates can't be converted to time_t or printed */
+                if( millisecs == millisecs && millisecs < 1e15 && millisecs > -1e15 )
+                {
+                    timestamp = millisecs / 1000;
+                    if( (date = gmtime(&timestamp)) )
+                        text = asctime(date);
+                }
+                out_printf("Value: %s\tTimezone: %+g\n", text ? text : "invalid\n",
                        (double) tz_offset / 60);
             }
             break;
         case 12:
-            printf("Long String\tValue: ");
-            pos = parse_script_string(pos + 2, conv_ui32(pos));
+            out_printf("Long String\tValue: ");
+            pos = parse_script_string(pos, end, 4);
             break;
         default:
-            printf("ERROR\n");
+            out_printf("ERROR\n");
             break;
     }
 
     return pos;
 }
 
+/*
+ * parse_script_string()
+ * 
+ * Print the string starting at "pos", preceded by its length in
+ * "length_size" (2 or 4) bytes.
+ * 
+ * Returns a pointer to the byte following the string, or NULL if it runs
+ * past "end".
+ */
+static const unsigned char *parse_script_string(const unsigned char *pos, const unsigned char *end, int length_size)
+{
+    unsigned long string_length;
+
+    if( end - pos < length_size )
+        return NULL;
+    string_length = (length_size == 2) ? conv_ui16(pos) : conv_ui32(pos);
+    pos += length_size;
+    if( (unsigned long)(end - pos) < string_length )
+        return NULL;
+
+    out_write((const char *)pos, string_length);
+
+    return pos + string_length;
+}
+
+/*
+ * list_tags()
+ * 
+ * Print a one-line description of every tag in the mapped file "map", in
+ * the format "format":
+ *   LIST_INDEX  tab-separated byte offset, tag type, data size and timestamp
+ *   LIST_JSON   a JSON object per line (JSON Lines), including the decoded
+ *               contents of script tags
+ *   LIST_CSV    comma-separated values with a fixed set of columns
+ * The tag headers are decoded in batches with the bulk scanner rather than
+ * reading the file a tag at a time. Tags whose back-pointer doesn't match
+ * their length are flagged, as is a truncated final tag.
+ */
+static void list_tags(const struct FLVmap *map, int format)
+{
+    struct FLVscan scan;
+    size_t offset;
+
+    memset(&scan, 0, sizeof(scan));
+
+    if( format == LIST_INDEX )
+        out_str("Offset\tType\tSize\tTimestamp\n");
+    else if( format == LIST_CSV )
+        out_str("offset,type,size,timestamp,backptr_ok,keyframe,avc_packet_type\n");
+
+    offset = scan_header(map->base, map->length);
+    do {
+        size_t i, bad;
+
+        scan_reset(&scan);
+        offset = scan_tags(map->base, map->length, offset, &scan, SCAN_BATCH);
+        bad = scan_check_backptrs(&scan, 0);
+
+        for( i = 0; i < scan.count; i++ )
+        {
+            const unsigned char *payload = map->base + scan.offsets[i] + 11;
+            int backptr_ok = (i != bad);
+            int keyframe = 0, avc_type = -1;
+
+            if( !backptr_ok )
+                bad = scan_check_backptrs(&scan, i + 1);
+            if( scan.types[i] == 9 && scan.sizes[i] >= 2 )
+            {
+                keyframe = ((payload[0] & 0xf0) >> 4 == 1);
+                if( (payload[0] & 0x0f) == 7 )
+                    avc_type = payload[1];
+            }
+
+            switch( format )
+            {
+                case LIST_INDEX:
+                    out_uint(scan.offsets[i]);
+                    out_write("\t", 1);
+                    out_uint(scan.types[i]);
+                    out_write("\t", 1);
+                    out_uint(scan.sizes[i]);
+                    out_write("\t", 1);
+                    out_uint(scan.timestamps[i]);
+                    if( !backptr_ok )
+                        out_printf("\tBad back-pointer %u", scan.backptrs[i]);
+                    break;
+                case LIST_CSV:
+                    out_uint(scan.offsets[i]);
+                    out_write(",", 1);
+                    out_str(tag_type_name(scan.types[i]));
+                    out_write(",", 1);
+                    out_uint(scan.sizes[i]);
+                    out_write(",", 1);
+                    out_uint(scan.timestamps[i]);
+                    out_str(backptr_ok ? ",1," : ",0,");
+                    out_str(keyframe ? "1," : "0,");
+                    if( avc_type != -1 )
+                        out_uint(avc_type);
+                    break;
+                case LIST_JSON:
+                    out_str("{\"offset\":");
+                    out_uint(scan.offsets[i]);
+                    out_str(",\"type\":\"");
+                    out_str(tag_type_name(scan.types[i]));
+                    out_str("\",\"size\":");
+                    out_uint(scan.sizes[i]);
+                    out_str(",\"timestamp\":");
+                    out_uint(scan.timestamps[i]);
+                    out_str(backptr_ok ? ",\"backptr_ok\":true" : ",\"backptr_ok\":false");
+                    if( scan.types[i] == 9 )
+                        out_str(keyframe ? ",\"keyframe\":true" : ",\"keyframe\":false");
+                    if( avc_type != -1 )
+                    {
+                        out_str(",\"avc_packet_type\":");
+                        out_uint(avc_type);
+                    }
+                    if( scan.types[i] == 18 )
+                    {
+                        out_str(",\"data\":");
+                        json_script_data(payload, scan.sizes[i]);
+                    }
+                    out_write("}", 1);
+                    break;
+            }
+            out_write("\n", 1);
+        }
+    } while( scan.count == SCAN_BATCH );
+
+    if( offset < map->length )
+    {
+        if( format == LIST_JSON )
+            out_printf("{\"offset\":%llu,\"truncated\":true}\n", (unsigned long long)offset);
+        else if( format == LIST_INDEX )
+            out_printf("Truncated tag at offset %llu\n", (unsigned long long)offset);
+        else
+            fprintf(stderr, "Truncated tag at offset %llu\n", (unsigned long long)offset);
+    }
+
+    scan_free(&scan);
+    out_flush();
+
+    return;
+}
+
+/*
+ * print_metadata_json()
+ * 
+ * Print the value of the first "onMetaData" object found in the script tags
+ * of the mapped file "map" as a JSON document, or null if there is none.
+ */
+static void print_metadata_json(const struct FLVmap *map)
+{
+    struct FLVscan scan;
+    size_t offset;
+    int found = 0;
+
+    memset(&scan, 0, sizeof(scan));
+    offset = scan_header(map->base, map->length);
+    do {
+        size_t i;
+
+        scan_reset(&scan);
+        offset = scan_tags(map->base, map->length, offset, &scan, SCAN_BATCH);
+
+        for( i = 0; i < scan.count && !found; i++ )
+        {
+            const unsigned char *pos = map->base + scan.offsets[i] + 11;
+            const unsigned char *end = pos + scan.sizes[i];
+            static const char name[] = "onMetaData";
+
+            if( scan.types[i] != 18 )
+                continue;
+            if( pos < end && *pos == 2 ) /* String marker */
+                pos++;
+            if( end - pos >= 2 + (long)sizeof(name) - 1 && conv_ui16(pos) == sizeof(name) - 1 &&
+                memcmp(pos + 2, name, sizeof(name) - 1) == 0 )
+            {
+                json_amf_value(pos + 2 + sizeof(name) - 1, end, 0);
+                found = 1;
+            }
+        }
+    } while( !found && scan.count == SCAN_BATCH );
+
+    if( !found )
+        out_str("null");
+    out_write("\n", 1);
+
+    scan_free(&scan);
+    out_flush();
+
+    return;
+}
+
+/*
+ * tag_type_name()
+ * 
+ * Returns a short name for FLV tag type "type".
+ */
+static const char *tag_type_name(unsigned char type)
+{
+    switch( type )
+    {
+        case 8:
+            return "audio";
+        case 9:
+            return "video";
+        case 18:
+            return "script";
+    }
+    return "other";
+}
+
+/*
+ * json_script_data()
+ * 
+ * Print the "length" bytes of script data at "data" as a JSON object
+ * mapping each name in the data to its value.
+ */
+static void json_script_data(const unsigned char *data, size_t length)
+{
+    const unsigned char *pos = data, *end = data + length;
+    int first = 1;
 
-unsigned char *parse_script_string(unsigned char *pos, unsigned int string_length)
-{   
-    unsigned int count;
+    out_write("{", 1);
+    while( end - pos >= 3 )
+    {
+        unsigned int name_length;
 
-    for( count = 0; count < string_length; count++)
-        putchar((char)pos[count]);   
+        if( pos[0] == 0 && pos[1] == 0 && pos[2] == 9 )
+            break; /* Closing bytes */
+        if( *pos == 2 ) /* String marker */
+            pos++;
+        name_length = conv_ui16(pos);
+        if( end - pos < 2 + (long)name_length )
+            break;
+        if( !first )
+            out_write(",", 1);
+        json_string(pos + 2, name_length);
+        out_write(":", 1);
+        first = 0;
+        pos = json_amf_value(pos + 2 + name_length, end, 0);
+        if( !pos )
+            break;
+    }
+    out_write("}", 1);
 
-    pos += string_length;
+    return;
+}
+
+/*
+ * json_amf_value()
+ * 
+ * Print the script data value starting at "pos" (and ending no later than
+ * "end") as JSON, descending no more than MAX_AMF_DEPTH levels into nested
+ * objects and arrays.
+ * 
+ * Returns a pointer to the byte following the value, or NULL if the data is
+ * malformed; the JSON printed is still complete in that case, with null in
+ * place of the bad value.
+ */
+static const unsigned char *json_amf_value(const unsigned char *pos, const unsigned char *end, int depth)
+{
+    unsigned char variable_type;
+
+    if( pos >= end || depth > MAX_AMF_DEPTH )
+    {
+        out_str("null");
+        return NULL;
+    }
+
+    variable_type = *pos++;
+    switch( variable_type )
+    {
+        case 0: /* double */
+            if( end - pos < 8 )
+                break;
+            json_number(conv_double(pos));
+            return pos + 8;
+        case 1: /* boolean */
+            if( end - pos < 1 )
+                break;
+            out_str(*pos ? "true" : "false");
+            return pos + 1;
+        case 2: /* string */
+            if( end - pos < 2 || end - pos - 2 < conv_ui16(pos) )
+                break;
+            json_string(pos + 2, conv_ui16(pos));
+            return pos + 2 + conv_ui16(pos);
+        case 3: /* object */
+            return json_amf_properties(pos, end, depth + 1);
+        case 4: /* movieclip */
+        case 5: /* null */
+        case 6: /* undefined */
+            out_str("null");
+            return pos;
+        case 7: /* reference */
+            if( end - pos < 2 )
+                break;
+            out_uint(conv_ui16(pos));
+            return pos + 2;
+        case 8: /* ECMA array; the count is only a hint */
+            if( end - pos < 4 )
+                break;
+            return json_amf_properties(pos + 4, end, depth + 1);
+        case 10: /* script (strict) array */
+            {
+                unsigned long count, i;
+
+                if( end - pos < 4 )
+                    break;
+                count = conv_ui32(pos);
+                pos += 4;
+                out_write("[", 1);
+                for( i = 0; i < count && pos; i++ )
+                {
+                    if( i > 0 )
+                        out_write(",", 1);
+                    pos = json_amf_value(pos, end, depth + 1);
+                }
+                out_write("]", 1);
+                return pos;
+            }
+        case 11: /* date: millisecs since epoch + timezone offset */
+            if( end - pos < 10 )
+                break;
+            json_number(conv_double(pos));
+            return pos + 10;
+        case 12: /* long string */
+            if( end - pos < 4 || (unsigned long)(end - pos - 4) < conv_ui32(pos) )
+                break;
+            json_string(pos + 4, conv_ui32(pos));
+            return pos + 4 + conv_ui32(pos);
+    }
+
+    /* Unknown type, or not enough data left */
+    out_str("null");
+    return NULL;
+}
+
+/*
+ * json_amf_properties()
+ * 
+ * Print the name/value pairs of a script data object or ECMA array starting
+ * at "pos" as a JSON object, up to the closing bytes 0, 0, 9.
+ * 
+ * Returns a pointer to the byte following the closing bytes, or NULL if the
+ * data is malformed.
+ */
+static const unsigned char *json_amf_properties(const unsigned char *pos, const unsigned char *end, int depth)
+{
+    int first = 1;
+
+    out_write("{", 1);
+    while( pos )
+    {
+        unsigned int name_length;
+
+        if( end - pos < 3 )
+        {
+            pos = NULL;
+            break;
+        }
+        if( pos[0] == 0 && pos[1] == 0 && pos[2] == 9 )
+        {
+            pos += 3;
+            break;
+        }
+        name_length = conv_ui16(pos);
+        if( end - pos - 2 < (long)name_length )
+        {
+            pos = NULL;
+            break;
+        }
+        if( !first )
+            out_write(",", 1);
+        json_string(pos + 2, name_length);
+        out_write(":", 1);
+        first = 0;
+        pos = json_amf_value(pos + 2 + name_length, end, depth);
+    }
+    out_write("}", 1);
 
     return pos;
 }
 
+/*
+ * json_string()
+ * 
+ * Print the "length" bytes at "string" as a quoted JSON string, escaping
+ * quotes, backslashes and control characters.
+ */
+static void json_string(const unsigned char *string, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t i, start = 0;
+
+    out_write("\"", 1);
+    for( i = 0; i < length; i++ )
+    {
+        unsigned char c = string[i];
+
+        if( c >= 0x20 && c != '"' && c != '\\' )
+            continue;
+        /* Write out the plain run before this character, then escape it */
+        out_write((const char *)string + start, i - start);
+        start = i + 1;
+        if( c == '"' || c == '\\' )
+        {
+            char esc[2] = { '\\', c };
+            out_write(esc, 2);
+        }
+        else
+        {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            out_write(esc, 6);
+        }
+    }
+    out_write((const char *)string + start, length - start);
+    out_write("\"", 1);
+
+    return;
+}
+
+/*
+ * json_number()
+ * 
+ * Print the number "number" in JSON form (null if it isn't finite).
+ */
+static void json_number(double number)
+{
+    if( !isfinite(number) )
+        out_str("null");
+    else if( number < 1e15 && number > -1e15 && number == (long long)number )
+        /* Only cast once the number is known to fit */
+        out_printf("%lld", (long long)number);
+    else
+    {
+        /* Use the shortest form that reads back as the same number */
+        char buff[32];
+
+        snprintf(buff, sizeof(buff), "%.15g", number);
+        if( strtod(buff, NULL) != number )
+            snprintf(buff, sizeof(buff), "%.17g", number);
+        out_str(buff);
+    }
+
+    return;
+}
+
+/*
+ * print_stats()
+ * 
+ * Print the aggregate statistics "stats" gathered from the file "filename".
+ */
+static void print_stats(const char *filename, const struct FLVstats *stats)
+{
+    double duration = stats->first_timestamp == -1 ? 0 :
+                      (stats->last_timestamp - stats->first_timestamp) / 1000.0;
+
+    out_printf("File: %s\n", filename);
+    out_printf("File size: %llu bytes\n", stats->file_size);
+    out_printf("Tags: %lu (audio %lu, video %lu, script %lu, other %lu)\n", stats->tags,
+               stats->audio.tags, stats->video.tags + stats->seq_headers,
+               stats->script_tags, stats->other_tags);
+    out_printf("Duration: %.3f s\n", duration);
+    print_stream_stats("Audio", &stats->audio, duration);
+    print_stream_stats("Video", &stats->video, duration);
+    out_printf("Script: %llu bytes\n", stats->script_bytes);
+    out_printf("Bitrate: average %.1f kbit/s, peak %.1f kbit/s (1 s window), %.1f kbit/s (10 s window)\n",
+               duration > 0 ? (stats->audio.bytes + stats->video.bytes) * 8 / duration / 1000 : 0,
+               stats->peak_1s * 8 / 1000.0, stats->peak_10s * 8 / 10000.0);
+
+    out_printf("Keyframes: %lu", stats->keyframes);
+    if( stats->intervals > 0 )
+        out_printf(", interval min %lu ms, average %.0f ms, max %lu ms", stats->interval_min,
+                   (double)stats->interval_total / stats->intervals, stats->interval_max);
+    out_str("\n");
+    if( stats->intervals > 0 )
+        print_histogram("Keyframe interval (ms)", stats->interval_hist, stats_interval_bins,
+                        STATS_INTERVAL_BINS);
+    if( stats->gops > 0 )
+    {
+        out_printf("GOP length: min %lu, average %.1f, max %lu frames\n", stats->gop_min,
+                   (double)stats->gop_total / stats->gops, stats->gop_max);
+        print_histogram("GOP length (frames)", stats->gop_hist, stats_gop_bins, STATS_GOP_BINS);
+    }
+
+    out_printf("AVC sequence headers: %lu (%lu changes)\n", stats->seq_headers,
+               stats->seq_header_changes);
+    if( stats->truncated )
+        out_str("WARNING: Final tag truncated\n");
+
+    return;
+}
+
+/*
+ * print_stream_stats()
+ * 
+ * Print the byte count and timestamp behaviour of the stream called "name"
+ * described by "stream", in a file of duration "duration" seconds.
+ */
+static void print_stream_stats(const char *name, const struct FLVstream_stats *stream, double duration)
+{
+    out_printf("%s: %lu tags, %llu bytes, average %.1f kbit/s\n", name, stream->tags, stream->bytes,
+               duration > 0 ? stream->bytes * 8 / duration / 1000 : 0);
+    if( stream->tags == 0 )
+        return;
+
+    out_printf("%s timestamps: %ld to %ld ms, %lu gaps (> %d ms), %lu jumps (> %d ms), %lu regressions\n",
+               name, stream->first_timestamp, stream->last_timestamp, stream->gaps, STATS_GAP_MS,
+               stream->jumps, STATS_JUMP_MS, stream->regressions);
+    if( stream->largest_gap > STATS_GAP_MS )
+        out_printf("%s largest gap: %ld ms after %ld ms\n", name, stream->largest_gap,
+                   stream->largest_gap_at);
+    if( stream->regressions > 0 )
+        out_printf("%s largest regression: %ld ms at %ld ms\n", name, stream->largest_regression,
+                   stream->largest_regression_at);
+
+    return;
+}
+
+/*
+ * print_histogram()
+ * 
+ * Print histogram "hist" called "name", whose "nbins" bins have the upper
+ * bounds "bins" (the last bin being open-ended).
+ */
+static void print_histogram(const char *name, const unsigned long *hist, const unsigned long *bins, int nbins)
+{
+    int i;
+
+    out_printf("%s:\n", name);
+    for( i = 0; i < nbins; i++ )
+    {
+        if( i < nbins - 1 )
+            out_printf("  <= %-6lu %lu\n", bins[i], hist[i]);
+        else
+            out_printf("   > %-6lu %lu\n", bins[i - 1], hist[i]);
+    }
+
+    return;
+}
+
+/*
+ * print_audit()
+ * 
+ * Print a report on the "count" files audited in "jobs": a line for each
+ * file, in the order they were given, followed by totals.
+ */
+static void print_audit(const struct FLVaudit_job *jobs, size_t count)
+{
+    unsigned long long total_size = 0;
+    double total_duration = 0;
+    unsigned long unreadable = 0, truncated = 0, regressions = 0, discontinuous = 0;
+    size_t i;
+
+    out_str("File\tSize\tDuration\tTags\tAudio kbit/s\tVideo kbit/s\tGaps\tJumps\tRegressions\tStatus\n");
+    for( i = 0; i < count; i++ )
+    {
+        const struct FLVstats *stats = &jobs[i].stats;
+        double duration = stats->first_timestamp == -1 ? 0 :
+                          (stats->last_timestamp - stats->first_timestamp) / 1000.0;
+        unsigned long gaps = stats->audio.gaps + stats->video.gaps;
+        unsigned long jumps = stats->audio.jumps + stats->video.jumps;
+        unsigned long regress = stats->audio.regressions + stats->video.regressions;
+
+        out_str(jobs[i].filename);
+        if( jobs[i].error )
+        {
+            out_printf("\t\t\t\t\t\t\t\t\tERROR: %s\n", strerror(jobs[i].error));
+            unreadable++;
+            continue;
+        }
+        out_printf("\t%llu\t%.3f\t%lu\t%.1f\t%.1f\t%lu\t%lu\t%lu\t%s\n", jobs[i].size, duration,
+                   stats->tags, duration > 0 ? stats->audio.bytes * 8 / duration / 1000 : 0,
+                   duration > 0 ? stats->video.bytes * 8 / duration / 1000 : 0,
+                   gaps, jumps, regress, stats->truncated ? "TRUNCATED" : "OK");
+
+        total_size += jobs[i].size;
+        total_duration += duration;
+        if( stats->truncated )
+            truncated++;
+        if( regress > 0 )
+            regressions++;
+        if( gaps + jumps > 0 )
+            discontinuous++;
+    }
+
+    out_printf("Files: %lu (%lu unreadable, %lu truncated, %lu with timestamp regressions, "
+               "%lu with gaps or jumps)\n", (unsigned long)count, unreadable, truncated,
+               regressions, discontinuous);
+    out_printf("Total size: %llu bytes, total duration: %.3f s\n", total_size, total_duration);
+
+    return;
+}
+
+/*
+ * print_check()
+ * 
+ * Print the result "check" of checking the structure of file "filename".
+ * 
+ * Returns 0 if the file is sound, or 1 if a problem was found.
+ */
+static int print_check(const char *filename, const struct FLVcheck *check)
+{
+    out_str(filename);
+    if( check->problem )
+        out_printf(": CORRUPT at offset %llu: %s; last good offset %llu (%lu good tags)",
+                   (unsigned long long)check->first_bad_offset, check->problem,
+                   (unsigned long long)check->last_good_offset, check->tags);
+    else
+        out_printf(": OK (%lu tags)", check->tags);
+    if( check->regressions > 0 )
+        out_printf("; %lu timestamp regressions, first at offset %llu", check->regressions,
+                   (unsigned long long)check->first_regression_offset);
+    out_write("\n", 1);
+
+    return check->problem != NULL;
+}
+
+/*
+ * print_check_audit()
+ * 
+ * Print the results of checking the structure of the "count" files in
+ * "jobs", followed by totals.
+ * 
+ * Returns 0 if all the files are sound, or 1 otherwise.
+ */
+static int print_check_audit(const struct FLVaudit_job *jobs, size_t count)
+{
+    unsigned long unreadable = 0, corrupt = 0;
+    size_t i;
+
+    for( i = 0; i < count; i++ )
+    {
+        if( jobs[i].error )
+        {
+            out_printf("%s: ERROR: %s\n", jobs[i].filename, strerror(jobs[i].error));
+            unreadable++;
+        }
+        else
+            corrupt += print_check(jobs[i].filename, &jobs[i].check);
+    }
+    out_printf("Files: %lu (%lu unreadable, %lu corrupt)\n", (unsigned long)count, unreadable, corrupt);
+
+    return unreadable + corrupt > 0;
+}
+
+/*
+ * out_flush()
+ * 
+ * Write out any output collected in the output buffer.
+ */
+static void out_flush(void)
+{
+    if( outlen > 0 && fwrite(outbuff, 1, outlen, stdout) != outlen )
+    {
+        fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+        exit(1);
+    }
+    outlen = 0;
+
+    return;
+}
+
+/*
+ * out_write()
+ * 
+ * Add "length" bytes starting at "data" to the output buffer, flushing it
+ * first if there isn't room.
+ */
+static void out_write(const char *data, size_t length)
+{
+    if( outlen + length > OUTBUFF_SIZE )
+    {
+        out_flush();
+        if( length > OUTBUFF_SIZE )
+        {
+            fwrite(data, 1, length, stdout);
+            return;
+        }
+    }
+    memcpy(outbuff + outlen, data, length);
+    outlen += length;
+
+    return;
+}
+
+/*
+ * out_str()
+ * 
+ * Add the string "string" to the output buffer.
+ */
+static void out_str(const char *string)
+{
+    out_write(string, strlen(string));
+    return;
+}
+
+/*
+ * out_uint()
+ * 
+ * Add the decimal representation of "number" to the output buffer, without
+ * going through printf().
+ */
+static void out_uint(unsigned long number)
+{
+    char digits[24];
+    int i = sizeof(digits);
+
+    do {
+        digits[--i] = '0' + number % 10;
+        number /= 10;
+    } while( number > 0 );
+    out_write(digits + i, sizeof(digits) - i);
+
+    return;
+}
+
+/*
+ * out_printf()
+ * 
+ * Format a string as printf() would and add it to the output buffer.
+ */
+static void out_printf(const char *format, ...)
+{
+    va_list ap;
+    int length;
+
+    if( OUTBUFF_SIZE - outlen < 256 )
+        out_flush();
+
+    va_start(ap, format);
+    length = vsnprintf(outbuff + outlen, OUTBUFF_SIZE - outlen, format, ap);
+    va_end(ap);
+
+    if( length < 0 )
+        return;
+    if( (size_t)length >= OUTBUFF_SIZE - outlen )
+    {
+        /* Didn't fit; format it again into a buffer of its own */
+        char *tmp = malloc(length + 1);
+
+        va_start(ap, format);
+        vsnprintf(tmp, length + 1, format, ap);
+        va_end(ap);
+        out_write(tmp, length);
+        free(tmp);
+    }
+    else
+        outlen += length;
+
+    return;
+}
 
 int main(int argc, char **argv)
 {
     FILE *fd;
+    struct FLVmap map;
+    int list_format = -1, summary = 0, metadata_json = 0, validate = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *listfile = NULL;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "isjcmvl:t:h")) != -1 ) 
+    {
+        switch (opt)
+        {
+            case 'i':
+                list_format = LIST_INDEX;
+                break;
+            case 'j':
+                list_format = LIST_JSON;
+                break;
+            case 'c':
+                list_format = LIST_CSV;
+                break;
+            case 'm':
+                metadata_json = 1;
+                break;
+            case 's':
+                summary = 1;
+                break;
+            case 'v':
+                validate = 1;
+                break;
+            case 'l':
+                listfile = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'h':
+            default:
+                fprintf(stderr, "Usage: flvparse [-i | -j | -c | -m | -s | -v] [<filename>]\n");
+                fprintf(stderr, "       flvparse [-v] [-t <threads>] [-l <listfile>] [<filename or directory> ...]\n\n");
+                fprintf(stderr, "   -i   Print a tag index (offset, type, size, timestamp) only\n");
+                fprintf(stderr, "   -j   Describe each tag as a line of JSON (JSON Lines)\n");
+                fprintf(stderr, "   -c   Describe each tag as a line of CSV\n");
+                fprintf(stderr, "   -m   Print the onMetaData object as a JSON document\n");
+                fprintf(stderr, "   -s   Print summary statistics instead of describing each tag\n");
+                fprintf(stderr, "   -v   Check the file structure; exit status is 1 if it is corrupt\n");
+                fprintf(stderr, "   -l   Audit the files (or directories) listed in <listfile> (- for stdin)\n");
+                fprintf(stderr, "   -t   Number of threads to use for an audit (default: number of CPUs)\n");
+                fprintf(stderr, "\nReads from standard input if no filename is given. If several files, a\n");
+                fprintf(stderr, "directory or a list file are given, they are audited in parallel and one\n");
+                fprintf(stderr, "line of summary statistics is printed for each file, followed by totals.\n");
+                fprintf(stderr, "The -i, -j, -c and -m options can only be used with a single file.\n");
+                exit(0);
+        }
+    }
 
-    if(argc > 1)
     {
-        fd = fopen(argv[1], "rb");
+        struct stat s;
+
+        if( listfile || argc - optind > 1 ||
+            (optind < argc && stat(argv[optind], &s) == 0 && S_ISDIR(s.st_mode)) )
+        {
+            /* Multi-file audit */
+            struct FLVaudit_job *jobs = NULL;
+            size_t count = 0;
+
+            if( list_format != -1 || metadata_json )
+            {
+                fprintf(stderr, "ERROR: The -i, -j, -c and -m options can only be used with a single file.\n");
+                exit(1);
+            }
+            if( listfile )
+            {
+                FILE *list = strcmp(listfile, "-") == 0 ? stdin : fopen(listfile, "r");
+
+                if( !list )
+                {
+                    fprintf(stderr, "Error opening file %s\n", listfile);
+                    exit(1);
+                }
+                jobs = audit_add_list(jobs, &count, list);
+                if( list != stdin )
+                    fclose(list);
+            }
+            for( ; optind < argc; optind++ )
+                jobs = audit_add_path(jobs, &count, argv[optind]);
+
+            if( validate )
+            {
+                int ret;
+
+                audit_run(jobs, count, threads, AUDIT_CHECK);
+                ret = print_check_audit(jobs, count);
+                out_flush();
+                return ret;
+            }
+            audit_run(jobs, count, threads, AUDIT_STATS);
+            print_audit(jobs, count);
+            out_flush();
+            return 0;
+        }
+    }
+
+    if(optind < argc)
+    {
+        fd = fopen(argv[optind], "rb");
         if(!fd)
         {
-            fprintf(stderr, "Error opening file %s\n", argv[1]);
+            fprintf(stderr, "Error opening file %s\n", argv[optind]);
             exit(1);
         }
     } 
     else
         fd = stdin;
 
-    parse_file(fd);
+    if( map_stream(fd, &map) != 0 )
+    {
+        fprintf(stderr, "Error reading file: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if(validate)
+    {
+        struct FLVcheck check;
+        int ret;
+
+        check_file(&check, &map);
+        ret = print_check(optind < argc ? argv[optind] : "-", &check);
+        out_flush();
+        unmap_file(&map);
+        return ret;
+    }
+    else if(summary)
+    {
+        struct FLVstats stats;
+
+        stats_file(&stats, &map);
+        print_stats(optind < argc ? argv[optind] : "-", &stats);
+        out_flush();
+    }
+    else if(metadata_json)
+        print_metadata_json(&map);
+    else if(list_format != -1)
+        list_tags(&map, list_format);
+    else
+        parse_file(&map);
+
+    unmap_file(&map);
 
     fclose(fd);
 
@@ -0,0 +1,574 @@
+/* 
+    flvscan.c
+    Bulk decoding of FLV tag headers from a memory-mapped file, for building
+    indexes and checking file structure without reading the payloads.
+    by Paul Kelly
+    Copyright (C) 2007-09 Radiomonitor Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "data_conv.h"
+#include "flvscan.h"
+
+/* Back-pointers are compared in blocks of this many tags */
+#define CHECK_BLOCK 64
+
+#ifdef __GNUC__
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr)
+#endif
+
+/* Whether map_stream() asks for the whole of a mapped file to be read ahead;
+ * callers trying to keep the page cache clear turn this off */
+int map_readahead = 1;
+
+static void scan_grow(struct FLVscan *, size_t);
+static int header_plausible(const unsigned char *, size_t, size_t);
+static int tag_confirmed(const unsigned char *, size_t, size_t);
+
+/*
+ * map_file()
+ * 
+ * Map the whole of the file "filename" into memory and describe it in "map".
+ * 
+ * Returns 0 on success, or -1 (with errno set) if the file couldn't be
+ * opened or read.
+ */
+int map_file(const char *filename, struct FLVmap *map)
+{
+    FILE *fd = fopen(filename, "rb");
+    int ret;
+
+    if( !fd )
+        return -1;
+    ret = map_stream(fd, map);
+    fclose(fd);
+
+    return ret;
+}
+
+/*
+ * map_only()
+ * 
+ * Map the whole of the regular file open as "fd" into memory, whatever its
+ * current position, and describe it in "map". Unless "readahead" is set, the
+ * pages are left to be read in as they are visited. Nothing is ever read
+ * into memory in place of a mapping.
+ * 
+ * Returns 0 on success, or -1 if the file isn't a regular file or couldn't
+ * be mapped.
+ */
+int map_only(FILE *fd, struct FLVmap *map, int readahead)
+{
+    struct stat s;
+    void *base;
+
+    map->base = NULL;
+    map->length = 0;
+    map->mapped = 0;
+
+    if( fstat(fileno(fd), &s) != 0 || !S_ISREG(s.st_mode) )
+        return -1;
+    if( s.st_size == 0 )
+        return 0;
+    base = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fileno(fd), 0);
+    if( base == MAP_FAILED )
+        return -1;
+
+    /* Tags are visited in file order */
+    madvise(base, s.st_size, MADV_SEQUENTIAL);
+    if( readahead )
+        madvise(base, s.st_size, MADV_WILLNEED);
+    map->base = base;
+    map->length = s.st_size;
+    map->mapped = 1;
+
+    return 0;
+}
+
+/*
+ * map_stream()
+ * 
+ * Map the remainder of the already-open stream "fd" into memory and describe
+ * it in "map". Streams that can't be mapped (pipes, terminals) are read into
+ * a malloc'd buffer instead. The stream may be closed afterwards.
+ * 
+ * Returns 0 on success, or -1 (with errno set) on failure.
+ */
+int map_stream(FILE *fd, struct FLVmap *map)
+{
+    size_t alloc;
+
+    if( ftell(fd) == 0 && map_only(fd, map, map_readahead) == 0 )
+        return 0;
+
+    /* Fall back to reading the stream */
+    map->base = NULL;
+    map->length = 0;
+    map->mapped = 0;
+    alloc = 1 << 20;
+    map->base = malloc(alloc);
+    while( map->base )
+    {
+        size_t n = fread((unsigned char *)map->base + map->length, 1, alloc - map->length, fd);
+
+        map->length += n;
+        if( n == 0 )
+            break;
+        if( map->length == alloc )
+        {
+            alloc *= 2;
+            map->base = realloc((unsigned char *)map->base, alloc);
+        }
+    }
+    if( !map->base )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if( ferror(fd) )
+    {
+        unmap_file(map);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * unmap_file()
+ * 
+ * Release the memory used by a file mapped with map_file() or map_stream().
+ */
+void unmap_file(struct FLVmap *map)
+{
+    if( map->mapped )
+        munmap((void *)map->base, map->length);
+    else
+        free((void *)map->base);
+    map->base = NULL;
+    map->length = 0;
+
+    return;
+}
+
+/*
+ * scan_header()
+ * 
+ * Check for the FLV file header at the start of the "length" bytes at "base".
+ * 
+ * Returns the offset of the first tag, i.e. just after the header and the
+ * first back-pointer, or 0 if there is no header (the data is taken to be
+ * raw FLV tags).
+ */
+size_t scan_header(const unsigned char *base, size_t length)
+{
+    size_t header_length;
+
+    if( length < 9 || memcmp(base, "FLV", 3) != 0 )
+        return 0;
+
+    header_length = conv_ui32(&base[5]);
+    if( header_length < 9 )
+        header_length = 9;
+    if( header_length + 4 > length )
+        return length;
+
+    return header_length + 4;
+}
+
+/*
+ * scan_tags()
+ * 
+ * Decode the headers of up to "max_tags" consecutive tags, starting with the
+ * tag at byte offset "offset" of the "length" bytes at "base", and append
+ * them to "scan". Only the 11-byte header and the following back-pointer of
+ * each tag are read; the location of the next header is fetched while the
+ * current one is being decoded.
+ * 
+ * Returns the offset following the last complete tag decoded. A return value
+ * less than "length" when fewer than "max_tags" tags were decoded means the
+ * tag there is truncated.
+ */
+size_t scan_tags(const unsigned char *base, size_t length, size_t offset,
+                 struct FLVscan *scan, size_t max_tags)
+{
+    size_t n = scan->count;
+
+    scan_grow(scan, n + max_tags);
+
+    while( max_tags-- > 0 && offset + 15 <= length )
+    {
+        const unsigned char *hdr = base + offset;
+        unsigned int datasize = conv_ui24(&hdr[1], 0);
+        size_t next = offset + 11 + datasize + 4;
+
+        if( next > length )
+            break; /* Truncated tag */
+
+        /* Start fetching the next header now rather than when we need it */
+        PREFETCH(base + next);
+        PREFETCH(base + next + 11);
+
+        scan->types[n] = hdr[0];
+        scan->sizes[n] = datasize;
+        scan->timestamps[n] = conv_ui24(&hdr[4], hdr[7]);
+        scan->offsets[n] = offset;
+        scan->backptrs[n] = conv_ui32(base + next - 4);
+        n++;
+
+        offset = next;
+    }
+    scan->count = n;
+
+    return offset;
+}
+
+/*
+ * scan_check_backptrs()
+ * 
+ * Compare the back-pointer following each tag in "scan", starting at index
+ * "first", with the length of that tag (11 + datasize). The comparison is
+ * done a block at a time in a branch-free loop the compiler can vectorise,
+ * and a block is only examined in detail if it contains a mismatch.
+ * 
+ * Returns the index of the first tag whose back-pointer doesn't match, or
+ * scan->count if they all do.
+ */
+size_t scan_check_backptrs(const struct FLVscan *scan, size_t first)
+{
+    size_t i = first;
+
+    while( i < scan->count )
+    {
+        size_t end = i + CHECK_BLOCK, j;
+        unsigned int diff = 0;
+
+        if( end > scan->count )
+            end = scan->count;
+        for( j = i; j < end; j++ )
+            diff |= scan->backptrs[j] ^ (scan->sizes[j] + 11);
+        if( diff )
+        {
+            for( j = i; j < end; j++ )
+                if( scan->backptrs[j] != scan->sizes[j] + 11 )
+                    return j;
+        }
+        i = end;
+    }
+
+    return scan->count;
+}
+
+/*
+ * check_file()
+ * 
+ * Check the structure of the mapped file "map": the file header, that every
+ * tag has a known type, a zero stream ID and a back-pointer matching its
+ * length, and that the last tag is complete. Timestamps going backwards
+ * within the audio or video stream are counted but don't stop the check.
+ * The tag headers are decoded in batches by scan_tags() and each check is
+ * a separate pass over a batch, so the common case of a clean file runs
+ * through a few tight loops.
+ * The result is stored in "check"; check->problem is NULL if the file is
+ * sound.
+ */
+void check_file(struct FLVcheck *check, const struct FLVmap *map)
+{
+    struct FLVscan scan;
+    size_t offset;
+    long last_timestamp[2] = { -1, -1 }; /* audio, video */
+
+    memset(check, 0, sizeof(struct FLVcheck));
+    memset(&scan, 0, sizeof(scan));
+
+    if( map->length >= 3 && memcmp(map->base, "FLV", 3) == 0 )
+    {
+        if( map->length < 13 )
+        {
+            check->problem = "Truncated file header";
+            return;
+        }
+        if( conv_ui32(&map->base[5]) < 9 )
+        {
+            check->problem = "File header length less than 9 bytes";
+            return;
+        }
+        if( (uint64_t)conv_ui32(&map->base[5]) + 4 > map->length )
+        {
+            /* scan_header() would otherwise put the first tag at the end */
+            check->problem = "File header length beyond end of file";
+            return;
+        }
+        offset = scan_header(map->base, map->length);
+        if( conv_ui32(map->base + offset - 4) != 0 )
+        {
+            check->problem = "First back-pointer not zero";
+            check->first_bad_offset = offset - 4;
+            return;
+        }
+    }
+    else
+        offset = 0; /* Raw FLV tags */
+    check->last_good_offset = offset;
+
+    do {
+        size_t i, bad;
+
+        scan_reset(&scan);
+        offset = scan_tags(map->base, map->length, check->last_good_offset, &scan, SCAN_BATCH);
+
+        /* Find the first tag failing any of the checks */
+        bad = scan_check_backptrs(&scan, 0);
+        for( i = 0; i < bad; i++ )
+        {
+            unsigned char type = scan.types[i];
+
+            if( type != 8 && type != 9 && type != 18 )
+                break;
+        }
+        if( i < bad )
+            bad = i;
+        for( i = 0; i < bad; i++ )
+        {
+            const unsigned char *streamid = map->base + scan.offsets[i] + 8;
+
+            if( (streamid[0] | streamid[1] | streamid[2]) != 0 )
+                break;
+        }
+        if( i < bad )
+            bad = i;
+
+        for( i = 0; i < bad; i++ )
+        {
+            if( scan.types[i] != 18 )
+            {
+                long *last = &last_timestamp[scan.types[i] == 9];
+
+                if( (long)scan.timestamps[i] < *last && check->regressions++ == 0 )
+                    check->first_regression_offset = scan.offsets[i];
+                *last = scan.timestamps[i];
+            }
+        }
+
+        check->tags += bad;
+        if( bad < scan.count )
+        {
+            unsigned char type = scan.types[bad];
+
+            check->first_bad_offset = scan.offsets[bad];
+            check->last_good_offset = scan.offsets[bad];
+            if( type != 8 && type != 9 && type != 18 )
+                check->problem = "Unknown tag type";
+            else if( scan.backptrs[bad] != scan.sizes[bad] + 11 )
+                check->problem = "Back-pointer doesn't match tag length";
+            else
+                check->problem = "Stream ID not zero";
+            break;
+        }
+        check->last_good_offset = offset;
+    } while( scan.count == SCAN_BATCH );
+
+    if( !check->problem && offset < map->length )
+    {
+        const unsigned char *tag = map->base + offset;
+
+        /* A corrupt data size also makes a tag appear to run past the end */
+        if( offset + 11 > map->length )
+            check->problem = "Truncated tag header";
+        else if( tag[0] != 8 && tag[0] != 9 && tag[0] != 18 )
+            check->problem = "Unknown tag type";
+        else if( (tag[8] | tag[9] | tag[10]) != 0 )
+            check->problem = "Stream ID not zero";
+        else
+            check->problem = "Tag extends past end of file";
+        check->first_bad_offset = offset;
+    }
+
+    scan_free(&scan);
+    return;
+}
+
+/*
+ * scan_tag_valid()
+ * 
+ * Check that a sound tag starts at "offset" in the "length" bytes at "base":
+ * the tag type and stream ID must be valid and the whole tag must lie within
+ * the file. A back-pointer that doesn't match the tag length is tolerated if
+ * another plausible tag header (or the end of the file) follows it, so that
+ * one damaged back-pointer doesn't cost a good tag.
+ * 
+ * Returns nonzero if the tag is sound, or 0 otherwise.
+ */
+int scan_tag_valid(const unsigned char *base, size_t length, size_t offset)
+{
+    size_t end;
+
+    if( !header_plausible(base, length, offset) )
+        return 0;
+    end = offset + 15 + conv_ui24(base + offset + 1, 0);
+    if( end > length )
+        return 0;
+
+    return conv_ui32(base + end - 4) == end - offset - 4 ||
+           end == length || header_plausible(base, length, end);
+}
+
+/*
+ * scan_resync()
+ * 
+ * Search the "length" bytes at "base" from "offset" onwards for the start
+ * of the next tag, after damaged data has been found. Candidates are found
+ * by searching for the three tag type bytes with memchr() (which is
+ * vectorised by the C library), and a candidate is accepted only if its
+ * stream ID is zero, its back-pointer matches its length and it is followed
+ * by another plausible tag header or the end of the file.
+ * 
+ * Returns the offset of the tag found, or "length" if there is none.
+ */
+size_t scan_resync(const unsigned char *base, size_t length, size_t offset)
+{
+    static const unsigned char types[3] = { 8, 9, 18 };
+    const unsigned char *next[3];
+    int i;
+
+    if( offset >= length )
+        return length;
+    /* Keep the next occurrence of each type byte, and only search again
+     * for the one that has just been rejected */
+    for( i = 0; i < 3; i++ )
+        next[i] = memchr(base + offset, types[i], length - offset);
+
+    for( ;; )
+    {
+        int first = -1;
+
+        for( i = 0; i < 3; i++ )
+            if( next[i] && (first == -1 || next[i] < next[first]) )
+                first = i;
+        if( first == -1 )
+            return length;
+        if( tag_confirmed(base, length, next[first] - base) )
+            return next[first] - base;
+        next[first] = memchr(next[first] + 1, types[first], base + length - next[first] - 1);
+    }
+}
+
+/*
+ * header_plausible()
+ * 
+ * Returns nonzero if the bytes at "offset" could be the start of a tag
+ * header: a known tag type and a zero stream ID.
+ */
+static int header_plausible(const unsigned char *base, size_t length, size_t offset)
+{
+    const unsigned char *tag = base + offset;
+
+    if( offset + 11 > length )
+        return 0;
+
+    return (tag[0] == 8 || tag[0] == 9 || tag[0] == 18) && (tag[8] | tag[9] | tag[10]) == 0;
+}
+
+/*
+ * tag_confirmed()
+ * 
+ * Stricter version of scan_tag_valid() for candidates found while
+ * resynchronising: the back-pointer must match, and the tag must be followed
+ * by another plausible tag header or the end of the file.
+ * 
+ * Returns nonzero if the candidate is accepted.
+ */
+static int tag_confirmed(const unsigned char *base, size_t length, size_t offset)
+{
+    size_t end;
+
+    if( !header_plausible(base, length, offset) )
+        return 0;
+    end = offset + 15 + conv_ui24(base + offset + 1, 0);
+    if( end > length || conv_ui32(base + end - 4) != end - offset - 4 )
+        return 0;
+
+    return end == length || header_plausible(base, length, end);
+}
+
+/*
+ * scan_reset()
+ * 
+ * Empty "scan" ready for the next batch, keeping the arrays allocated.
+ */
+void scan_reset(struct FLVscan *scan)
+{
+    scan->count = 0;
+    return;
+}
+
+/*
+ * scan_free()
+ * 
+ * Free the arrays held by "scan".
+ */
+void scan_free(struct FLVscan *scan)
+{
+    free(scan->types);
+    free(scan->sizes);
+    free(scan->timestamps);
+    free(scan->offsets);
+    free(scan->backptrs);
+    memset(scan, 0, sizeof(struct FLVscan));
+
+    return;
+}
+
+/*
+ * scan_grow()
+ * 
+ * Make sure the arrays in "scan" have room for at least "needed" tags.
+ * 
+ * Prints an appropriate message to stderr and exits the program if memory
+ * can't be allocated.
+ */
+static void scan_grow(struct FLVscan *scan, size_t needed)
+{
+    if( needed <= scan->alloc )
+        return;
+
+    scan->alloc = needed > 2 * scan->alloc ? needed : 2 * scan->alloc;
+    scan->types = realloc(scan->types, scan->alloc);
+    scan->sizes = realloc(scan->sizes, scan->alloc * sizeof(unsigned int));
+    scan->timestamps = realloc(scan->timestamps, scan->alloc * sizeof(unsigned int));
+    scan->offsets = realloc(scan->offsets, scan->alloc * sizeof(uint64_t));
+    scan->backptrs = realloc(scan->backptrs, scan->alloc * sizeof(unsigned int));
+    if( !scan->types || !scan->sizes || !scan->timestamps || !scan->offsets || !scan->backptrs )
+    {
+        fprintf(stderr, "ERROR: Out of memory building tag index\n");
+        exit(1);
+    }
+
+    return;
+}
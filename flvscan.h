@@ -0,0 +1,181 @@
+/* flvscan.h */
+#ifndef FLVSCAN_H
+#define FLVSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A whole input file, memory-mapped where possible */
+struct FLVmap
+{
+    const unsigned char *base;
+    size_t length;
+    char mapped; /* 0 if the contents were read into a malloc'd buffer */
+};
+
+/* Decoded tag headers, held as separate arrays so that each pass over them
+ * only touches the fields it needs */
+struct FLVscan
+{
+    size_t count, alloc;
+    unsigned char *types;
+    unsigned int *sizes;
+    unsigned int *timestamps;
+    uint64_t *offsets;      /* of the first byte of the tag header */
+    unsigned int *backptrs; /* the back-pointer following each tag */
+};
+
+/* Number of tags decoded per call to scan_tags() by default */
+#define SCAN_BATCH 4096
+
+/* Result of checking the structure of a file */
+struct FLVcheck
+{
+    const char *problem;             /* first structural problem, or NULL */
+    uint64_t first_bad_offset;       /* where it was found */
+    uint64_t last_good_offset;       /* end of the last good tag before it */
+    unsigned long tags;              /* good tags before the problem */
+    unsigned long regressions;       /* timestamp regressions within a stream */
+    uint64_t first_regression_offset;
+};
+
+/* flvscan.c */
+extern int map_readahead;
+int map_file(const char *, struct FLVmap *);
+int map_only(FILE *, struct FLVmap *, int);
+int map_stream(FILE *, struct FLVmap *);
+void unmap_file(struct FLVmap *);
+size_t scan_header(const unsigned char *, size_t);
+size_t scan_tags(const unsigned char *, size_t, size_t, struct FLVscan *, size_t);
+size_t scan_check_backptrs(const struct FLVscan *, size_t);
+void check_file(struct FLVcheck *, const struct FLVmap *);
+int scan_tag_valid(const unsigned char *, size_t, size_t);
+size_t scan_resync(const unsigned char *, size_t, size_t);
+void scan_reset(struct FLVscan *);
+void scan_free(struct FLVscan *);
+
+/* Per-tag flags held in an FLVindex */
+#define TAG_AUDIO      0x01
+#define TAG_VIDEO      0x02
+#define TAG_SCRIPT     0x04
+#define TAG_KEYFRAME   0x08 /* video keyframe, or any audio tag */
+#define TAG_AVC_SEQHDR 0x10
+
+/* Maximum number of tags sharing one absolute timestamp and offset */
+#define INDEX_BLOCK 64
+
+/* A compact in-memory index of the tags in one file. Tags are grouped in
+ * blocks holding the absolute timestamp and byte offset of their first tag;
+ * each tag then only stores its timestamp and offset relative to those. */
+struct FLVindex
+{
+    size_t count, alloc;
+    size_t blocks, block_alloc;
+    /* Per block */
+    unsigned int *block_timestamp;
+    uint64_t *block_offset;
+    size_t *block_first;
+    /* Per tag */
+    int16_t *ts_delta;
+    uint32_t *offset_delta;
+    unsigned int *sizes;
+    unsigned char *flags;
+    /* Range of ts_delta values seen, and whether the block timestamps never
+     * decrease; these bound the tags a search has to visit */
+    int min_delta, max_delta;
+    char monotonic;
+};
+
+/* flvindex.c */
+int index_build(struct FLVindex *, const struct FLVmap *, size_t);
+void index_free(struct FLVindex *);
+size_t index_memory(const struct FLVindex *);
+unsigned int index_timestamp(const struct FLVindex *, size_t);
+uint64_t index_offset(const struct FLVindex *, size_t);
+long index_first_from(const struct FLVindex *, unsigned int, unsigned char);
+long index_last_before(const struct FLVindex *, unsigned int, unsigned char);
+uint64_t index_bytes(const struct FLVindex *, unsigned int, unsigned int);
+
+/* Timestamp steps larger than these (in ms) within a stream count as gaps
+ * and jumps respectively */
+#define STATS_GAP_MS  1000
+#define STATS_JUMP_MS 10000
+
+/* Bitrate is tracked in buckets of this many ms, over a ring of buckets
+ * covering the longest sliding window */
+#define STATS_BUCKET_MS 100
+#define STATS_BUCKETS   100
+
+/* Upper bounds of the histogram bins (the last bin is open-ended) */
+#define STATS_GOP_BINS 6      /* GOP length in frames */
+#define STATS_INTERVAL_BINS 7 /* Keyframe interval in ms */
+
+/* Timestamp behaviour of one stream */
+struct FLVstream_stats
+{
+    unsigned long tags;
+    unsigned long long bytes;
+    long first_timestamp, last_timestamp;
+    unsigned long gaps, jumps, regressions;
+    long largest_gap, largest_gap_at;
+    long largest_regression, largest_regression_at;
+};
+
+/* Aggregate statistics of an FLV file, gathered in a single pass using a
+ * fixed amount of memory */
+struct FLVstats
+{
+    unsigned long long file_size;
+    unsigned long tags, other_tags, script_tags;
+    unsigned long long script_bytes;
+    struct FLVstream_stats audio, video;
+    long first_timestamp, last_timestamp;
+    char truncated;
+
+    /* Bitrate */
+    unsigned long long ring[STATS_BUCKETS];
+    long bucket;
+    unsigned long long peak_1s, peak_10s; /* bytes in the busiest window */
+
+    /* Keyframes and GOPs */
+    unsigned long keyframes, frames_since_key;
+    long last_keyframe;
+    unsigned long gop_hist[STATS_GOP_BINS], interval_hist[STATS_INTERVAL_BINS];
+    unsigned long gop_min, gop_max, interval_min, interval_max;
+    unsigned long long gop_total, interval_total;
+    unsigned long gops, intervals;
+
+    /* AVC sequence headers */
+    unsigned long seq_headers, seq_header_changes;
+    uint32_t seq_header_hash;
+};
+
+/* flvstats.c */
+extern const unsigned long stats_gop_bins[STATS_GOP_BINS];
+extern const unsigned long stats_interval_bins[STATS_INTERVAL_BINS];
+void stats_init(struct FLVstats *);
+void stats_add_tag(struct FLVstats *, unsigned char, unsigned int, unsigned int, const unsigned char *);
+void stats_finish(struct FLVstats *);
+void stats_file(struct FLVstats *, const struct FLVmap *);
+
+/* One file in a multi-file audit */
+struct FLVaudit_job
+{
+    char *filename;
+    unsigned long long size;
+    int error; /* errno value if the file couldn't be read, otherwise 0 */
+    struct FLVstats stats;
+    struct FLVcheck check;
+};
+
+/* What audit_run() does with each file */
+#define AUDIT_STATS 1
+#define AUDIT_CHECK 2
+
+/* flvaudit.c */
+struct FLVaudit_job *audit_add_path(struct FLVaudit_job *, size_t *, const char *);
+struct FLVaudit_job *audit_add_list(struct FLVaudit_job *, size_t *, FILE *);
+void audit_run(struct FLVaudit_job *, size_t, int, int);
+
+#endif /* FLVSCAN_H */
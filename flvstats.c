@@ -0,0 +1,300 @@
+/* 
+    flvstats.c
+    Aggregate statistics of an FLV file (tag counts, bitrates, GOP structure
+    and timestamp problems), gathered in a single pass in constant memory.
+    by Paul Kelly
+    Copyright (C) 2007-09 Radiomonitor Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "data_conv.h"
+#include "flvscan.h"
+
+/* Upper bounds of the histogram bins; the last bin holds everything larger */
+const unsigned long stats_gop_bins[STATS_GOP_BINS] = { 9, 24, 49, 99, 249, 0 };
+const unsigned long stats_interval_bins[STATS_INTERVAL_BINS] = { 499, 999, 1999, 3999, 7999, 15999, 0 };
+
+static void stream_timestamp(struct FLVstream_stats *, long);
+static void count_bitrate(struct FLVstats *, long, unsigned int);
+static void close_bucket(struct FLVstats *);
+static void add_to_bin(unsigned long *, const unsigned long *, int, unsigned long);
+
+/*
+ * stats_init()
+ * 
+ * Prepare "stats" for gathering the statistics of a new file.
+ */
+void stats_init(struct FLVstats *stats)
+{
+    memset(stats, 0, sizeof(struct FLVstats));
+    stats->first_timestamp = stats->audio.first_timestamp = stats->video.first_timestamp = -1;
+    stats->last_keyframe = -1;
+    stats->bucket = -1;
+
+    return;
+}
+
+/*
+ * stats_add_tag()
+ * 
+ * Update "stats" with the tag of type "type", with "datasize" bytes of
+ * payload starting at "payload" and timestamp "timestamp".
+ */
+void stats_add_tag(struct FLVstats *stats, unsigned char type, unsigned int datasize,
+                   unsigned int timestamp, const unsigned char *payload)
+{
+    stats->tags++;
+
+    if( type == 18 )
+    {
+        stats->script_tags++;
+        stats->script_bytes += datasize;
+        return;
+    }
+    if( type != 8 && type != 9 )
+    {
+        stats->other_tags++;
+        return;
+    }
+
+    if( stats->first_timestamp == -1 || (long)timestamp < stats->first_timestamp )
+        stats->first_timestamp = timestamp;
+    if( (long)timestamp > stats->last_timestamp )
+        stats->last_timestamp = timestamp;
+    count_bitrate(stats, timestamp, datasize);
+
+    if( type == 8 )
+    {
+        stats->audio.bytes += datasize;
+        stream_timestamp(&stats->audio, timestamp);
+        return;
+    }
+
+    stats->video.bytes += datasize;
+    if( datasize >= 2 && (payload[0] & 0x0f) == 7 && payload[1] == 0 )
+    {
+        /* AVC sequence header; look for changes with an FNV-1a hash */
+        uint32_t hash = 2166136261u;
+        unsigned int i;
+
+        for( i = 0; i < datasize; i++ )
+            hash = (hash ^ payload[i]) * 16777619u;
+        if( stats->seq_headers > 0 && hash != stats->seq_header_hash )
+            stats->seq_header_changes++;
+        stats->seq_header_hash = hash;
+        stats->seq_headers++;
+        return; /* Not a frame */
+    }
+
+    stream_timestamp(&stats->video, timestamp);
+    if( datasize >= 1 && (payload[0] & 0xf0) >> 4 == 1 )
+    {
+        /* Keyframe; close off the previous GOP */
+        if( stats->last_keyframe != -1 )
+        {
+            unsigned long gop = stats->frames_since_key;
+            unsigned long interval = timestamp >= stats->last_keyframe ?
+                                     timestamp - stats->last_keyframe : 0;
+
+            add_to_bin(stats->gop_hist, stats_gop_bins, STATS_GOP_BINS, gop);
+            if( stats->gops == 0 || gop < stats->gop_min )
+                stats->gop_min = gop;
+            if( gop > stats->gop_max )
+                stats->gop_max = gop;
+            stats->gop_total += gop;
+            stats->gops++;
+
+            add_to_bin(stats->interval_hist, stats_interval_bins, STATS_INTERVAL_BINS, interval);
+            if( stats->intervals == 0 || interval < stats->interval_min )
+                stats->interval_min = interval;
+            if( interval > stats->interval_max )
+                stats->interval_max = interval;
+            stats->interval_total += interval;
+            stats->intervals++;
+        }
+        stats->keyframes++;
+        stats->last_keyframe = timestamp;
+        stats->frames_since_key = 0;
+    }
+    stats->frames_since_key++;
+
+    return;
+}
+
+/*
+ * stats_finish()
+ * 
+ * Complete the statistics in "stats" once all tags have been added.
+ */
+void stats_finish(struct FLVstats *stats)
+{
+    if( stats->bucket != -1 )
+        close_bucket(stats);
+
+    return;
+}
+
+/*
+ * stats_file()
+ * 
+ * Gather the statistics of the whole of the mapped file "map" into "stats",
+ * walking the tag headers with the bulk scanner.
+ */
+void stats_file(struct FLVstats *stats, const struct FLVmap *map)
+{
+    struct FLVscan scan;
+    size_t offset = scan_header(map->base, map->length);
+
+    stats_init(stats);
+    stats->file_size = map->length;
+    memset(&scan, 0, sizeof(scan));
+
+    do {
+        size_t i;
+
+        scan_reset(&scan);
+        offset = scan_tags(map->base, map->length, offset, &scan, SCAN_BATCH);
+        for( i = 0; i < scan.count; i++ )
+            stats_add_tag(stats, scan.types[i], scan.sizes[i], scan.timestamps[i],
+                          map->base + scan.offsets[i] + 11);
+    } while( scan.count == SCAN_BATCH );
+
+    stats->truncated = (offset < map->length);
+    stats_finish(stats);
+    scan_free(&scan);
+
+    return;
+}
+
+/*
+ * stream_timestamp()
+ * 
+ * Record timestamp "timestamp" of the next tag in a stream, counting any
+ * gaps, jumps or regressions since the previous one.
+ */
+static void stream_timestamp(struct FLVstream_stats *stream, long timestamp)
+{
+    stream->tags++;
+    if( stream->first_timestamp == -1 )
+        stream->first_timestamp = timestamp;
+    else
+    {
+        long delta = timestamp - stream->last_timestamp;
+
+        if( delta < 0 )
+        {
+            stream->regressions++;
+            if( -delta > stream->largest_regression )
+            {
+                stream->largest_regression = -delta;
+                stream->largest_regression_at = timestamp;
+            }
+        }
+        else if( delta > STATS_JUMP_MS )
+            stream->jumps++;
+        else if( delta > STATS_GAP_MS )
+            stream->gaps++;
+
+        if( delta > stream->largest_gap )
+        {
+            stream->largest_gap = delta;
+            stream->largest_gap_at = stream->last_timestamp;
+        }
+    }
+    stream->last_timestamp = timestamp;
+
+    return;
+}
+
+/*
+ * count_bitrate()
+ * 
+ * Add "bytes" bytes at timestamp "timestamp" to the bitrate buckets. Tags a
+ * little out of order still land in the right bucket as long as it is
+ * within the ring; older ones are dropped from the peak calculation.
+ */
+static void count_bitrate(struct FLVstats *stats, long timestamp, unsigned int bytes)
+{
+    long bucket = timestamp / STATS_BUCKET_MS;
+
+    if( stats->bucket == -1 )
+        stats->bucket = bucket;
+
+    if( bucket - stats->bucket >= STATS_BUCKETS )
+    {
+        /* Jumped past the whole ring */
+        close_bucket(stats);
+        memset(stats->ring, 0, sizeof(stats->ring));
+        stats->bucket = bucket;
+    }
+    while( stats->bucket < bucket )
+    {
+        close_bucket(stats);
+        stats->bucket++;
+        stats->ring[stats->bucket % STATS_BUCKETS] = 0;
+    }
+
+    if( bucket > stats->bucket - STATS_BUCKETS )
+        stats->ring[bucket % STATS_BUCKETS] += bytes;
+
+    return;
+}
+
+/*
+ * close_bucket()
+ * 
+ * Update the peak windows with the current bucket, which is complete.
+ */
+static void close_bucket(struct FLVstats *stats)
+{
+    unsigned long long sum = 0, sum_1s = 0;
+    int i;
+
+    for( i = 0; i < STATS_BUCKETS && stats->bucket - i >= 0; i++ )
+    {
+        sum += stats->ring[(stats->bucket - i) % STATS_BUCKETS];
+        if( i < 1000 / STATS_BUCKET_MS )
+            sum_1s = sum;
+    }
+    if( sum_1s > stats->peak_1s )
+        stats->peak_1s = sum_1s;
+    if( sum > stats->peak_10s )
+        stats->peak_10s = sum;
+
+    return;
+}
+
+/*
+ * add_to_bin()
+ * 
+ * Count "value" in the histogram "hist" whose "nbins" bins have the upper
+ * bounds "bins".
+ */
+static void add_to_bin(unsigned long *hist, const unsigned long *bins, int nbins, unsigned long value)
+{
+    int i;
+
+    for( i = 0; i < nbins - 1; i++ )
+        if( value <= bins[i] )
+            break;
+    hist[i]++;
+
+    return;
+}
@@ -0,0 +1,587 @@
+/*
+    flvuring.c
+    Queued writing of an output file through Linux io_uring, used by
+    flvjoin in place of stdio where the kernel supports it.
+    by Paul Kelly
+    Copyright (C) 2007-09 Radiomonitor Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "flvjoin.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* The output of every file is gathered in this many buffers, shared
+ * between the files and registered with the kernel once; each full buffer
+ * becomes one write */
+#define URING_BUFFERS 8
+/* Largest and smallest size of each buffer; they are made as large as the
+ * memory given to uring_setup() allows */
+#define URING_BUFFER_SIZE (1024 * 1024)
+#define URING_MIN_BUFFER_SIZE 4096
+/* Full buffers are handed to the kernel this many at a time */
+#define URING_BATCH 2
+/* Most files written through the queue at once, so that each can have a
+ * buffer being filled while another is written */
+#define URING_MAX_FILES (URING_BUFFERS / 2)
+
+/* The queue and buffers shared by all the files written */
+struct FLVuring_pool
+{
+    int ring_fd;
+    /* Submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned queued;   /* Entries added but not yet submitted */
+    /* Completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    /* Output buffers: each is free, being filled for a file, or being
+     * written to it */
+    unsigned char *buffers;
+    size_t buffer_size;
+    struct FLVuring *owner[URING_BUFFERS]; /* File it holds data for, or NULL */
+    size_t pending[URING_BUFFERS]; /* Bytes still to be written, 0 if not queued */
+    size_t written[URING_BUFFERS]; /* Bytes of the buffer written so far */
+    long buffer_offset[URING_BUFFERS];
+    unsigned in_flight;
+
+    struct FLVuring *files; /* Files open for writing */
+    unsigned file_count;
+};
+
+/* One file written through the shared queue */
+struct FLVuring
+{
+    int fd;
+    long offset;       /* File offset the buffer being filled will be written at */
+    int error;         /* errno value of the first failed write, or 0 */
+    int fill;          /* Buffer being filled, or -1 */
+    size_t fill_len;
+    unsigned in_flight; /* Buffers queued or being written */
+    struct FLVuring *next;
+};
+
+static struct FLVuring_pool *pool;
+
+static void release_pool(struct FLVuring_pool *);
+static int take_buffer(struct FLVuring *);
+static void queue_write(unsigned);
+static int submit_and_wait(unsigned);
+static void reap_completions(void);
+
+/*
+ * uring_setup()
+ *
+ * Set up the io_uring queue through which files are written, with buffers
+ * taking up at most "bytes" bytes in all. The system calls are made
+ * directly, so no library is needed. If the buffers can't all be locked
+ * in memory (as registered buffers must be), smaller ones are tried.
+ *
+ * Returns the number of bytes of buffers actually allocated, or 0 (with
+ * errno set) if io_uring can't be used, in which case the caller carries
+ * on with ordinary writes.
+ */
+size_t uring_setup(size_t bytes)
+{
+    struct FLVuring_pool *p;
+    struct io_uring_params params;
+    struct iovec iov[URING_BUFFERS];
+    size_t size = bytes / URING_BUFFERS;
+    unsigned i;
+
+    if( pool )
+        return pool->buffer_size * URING_BUFFERS;
+    if( size > URING_BUFFER_SIZE )
+        size = URING_BUFFER_SIZE;
+    size -= size % URING_MIN_BUFFER_SIZE;
+    if( size < URING_MIN_BUFFER_SIZE )
+    {
+        errno = ENOMEM;
+        return 0;
+    }
+    if( !(p = calloc(1, sizeof(struct FLVuring_pool))) )
+        return 0;
+    memset(&params, 0, sizeof(params));
+    p->ring_fd = syscall(__NR_io_uring_setup, URING_BUFFERS * 2, &params);
+    if( p->ring_fd < 0 )
+    {
+        free(p);
+        return 0;
+    }
+
+    /* Map the two rings and the submission queue entries */
+    p->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    p->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        if( p->cq_ring_size > p->sq_ring_size )
+            p->sq_ring_size = p->cq_ring_size;
+        p->cq_ring_size = p->sq_ring_size;
+    }
+    p->sq_ring = mmap(NULL, p->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      p->ring_fd, IORING_OFF_SQ_RING);
+    if( params.features & IORING_FEAT_SINGLE_MMAP )
+        p->cq_ring = p->sq_ring;
+    else if( p->sq_ring != MAP_FAILED )
+        p->cq_ring = mmap(NULL, p->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          p->ring_fd, IORING_OFF_CQ_RING);
+    p->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if( p->sq_ring != MAP_FAILED && p->cq_ring != MAP_FAILED )
+        p->sqes = mmap(NULL, p->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       p->ring_fd, IORING_OFF_SQES);
+    if( p->sq_ring == MAP_FAILED || p->cq_ring == MAP_FAILED || p->sqes == MAP_FAILED )
+    {
+        int saved = errno;
+
+        release_pool(p);
+        errno = saved;
+        return 0;
+    }
+    p->sq_head = (unsigned *)((char *)p->sq_ring + params.sq_off.head);
+    p->sq_tail = (unsigned *)((char *)p->sq_ring + params.sq_off.tail);
+    p->sq_mask = (unsigned *)((char *)p->sq_ring + params.sq_off.ring_mask);
+    p->sq_array = (unsigned *)((char *)p->sq_ring + params.sq_off.array);
+    p->cq_head = (unsigned *)((char *)p->cq_ring + params.cq_off.head);
+    p->cq_tail = (unsigned *)((char *)p->cq_ring + params.cq_off.tail);
+    p->cq_mask = (unsigned *)((char *)p->cq_ring + params.cq_off.ring_mask);
+    p->cqes = (struct io_uring_cqe *)((char *)p->cq_ring + params.cq_off.cqes);
+
+    /* Register the buffers so the kernel needn't map them for each write */
+    for( ;; )
+    {
+        int saved;
+
+        if( posix_memalign((void **)&p->buffers, 4096, (size_t)URING_BUFFERS * size) != 0 )
+        {
+            p->buffers = NULL;
+            release_pool(p);
+            errno = ENOMEM;
+            return 0;
+        }
+        for( i = 0; i < URING_BUFFERS; i++ )
+        {
+            iov[i].iov_base = p->buffers + (size_t)i * size;
+            iov[i].iov_len = size;
+        }
+        if( syscall(__NR_io_uring_register, p->ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0 )
+            break;
+        saved = errno;
+        free(p->buffers);
+        p->buffers = NULL;
+        size /= 2;
+        size -= size % URING_MIN_BUFFER_SIZE;
+        if( saved != ENOMEM || size < URING_MIN_BUFFER_SIZE )
+        {
+            release_pool(p);
+            errno = saved;
+            return 0;
+        }
+    }
+    p->buffer_size = size;
+    pool = p;
+
+    return size * URING_BUFFERS;
+}
+
+/*
+ * uring_open()
+ *
+ * Start writing the file descriptor "fd", a regular file, through the
+ * queue set up with uring_setup(), from byte offset "offset".
+ *
+ * Returns a handle for the file, or NULL (with errno set) if there is no
+ * queue, or (with errno set to EBUSY) if it already has as many files as
+ * it can usefully share its buffers between.
+ */
+struct FLVuring *uring_open(int fd, long offset)
+{
+    struct FLVuring *u;
+
+    if( !pool )
+    {
+        errno = ENOSYS;
+        return NULL;
+    }
+    if( pool->file_count >= URING_MAX_FILES )
+    {
+        errno = EBUSY;
+        return NULL;
+    }
+    if( !(u = calloc(1, sizeof(struct FLVuring))) )
+        return NULL;
+    u->fd = fd;
+    u->offset = offset;
+    u->fill = -1;
+    u->next = pool->files;
+    pool->files = u;
+    pool->file_count++;
+
+    return u;
+}
+
+/*
+ * uring_write()
+ *
+ * Add the "bytes" bytes at "data" to the output of file "u". They are
+ * copied into the file's current buffer; each buffer is queued for writing
+ * as soon as it is full, and only if no buffer is free does this wait.
+ *
+ * Returns 0, or -1 (with errno set) if an earlier write has failed.
+ */
+int uring_write(struct FLVuring *u, const unsigned char *data, size_t bytes)
+{
+    while( bytes > 0 && !u->error )
+    {
+        size_t n;
+
+        if( u->fill == -1 && (u->fill = take_buffer(u)) == -1 )
+            break;
+        n = pool->buffer_size - u->fill_len;
+        if( n > bytes )
+            n = bytes;
+        memcpy(pool->buffers + (size_t)u->fill * pool->buffer_size + u->fill_len, data, n);
+        u->fill_len += n;
+        data += n;
+        bytes -= n;
+        if( u->fill_len == pool->buffer_size )
+        {
+            queue_write(u->fill);
+            if( pool->queued >= URING_BATCH && submit_and_wait(0) != 0 )
+                u->error = errno;
+        }
+    }
+
+    if( u->error )
+    {
+        errno = u->error;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * uring_drain()
+ *
+ * Write out the partly filled buffer of file "u" and wait until every
+ * write queued for it is complete, so that the file holds everything given
+ * to uring_write().
+ *
+ * Returns 0, or -1 (with errno set) if any write failed.
+ */
+int uring_drain(struct FLVuring *u)
+{
+    if( u->fill != -1 && !u->error )
+        queue_write(u->fill);
+    while( u->in_flight > 0 && !u->error )
+        if( submit_and_wait(1) != 0 )
+            u->error = errno;
+
+    if( u->error )
+    {
+        errno = u->error;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * uring_offset()
+ *
+ * Returns the file offset just after the data given to uring_write().
+ */
+long uring_offset(const struct FLVuring *u)
+{
+    return u->offset + (long)u->fill_len;
+}
+
+/*
+ * uring_completed()
+ *
+ * Returns the file offset up to which everything given to uring_write()
+ * for file "u" is known to be in the file, without waiting for any write.
+ */
+long uring_completed(struct FLVuring *u)
+{
+    long done = u->offset;
+    unsigned i;
+
+    reap_completions();
+    for( i = 0; i < URING_BUFFERS; i++ )
+        if( pool->owner[i] == u && pool->pending[i] &&
+            pool->buffer_offset[i] + (long)pool->written[i] < done )
+            done = pool->buffer_offset[i] + (long)pool->written[i];
+
+    return done;
+}
+
+/*
+ * uring_close()
+ *
+ * Stop writing file "u" and release its handle. Any writes not yet
+ * drained are waited for but their outcome isn't reported; call
+ * uring_drain() first to find it. The shared queue stays set up.
+ */
+void uring_close(struct FLVuring *u)
+{
+    struct FLVuring **link;
+
+    while( u->in_flight > 0 && submit_and_wait(1) == 0 )
+        ;
+    if( u->fill != -1 )
+        pool->owner[u->fill] = NULL;
+    for( link = &pool->files; *link; link = &(*link)->next )
+        if( *link == u )
+        {
+            *link = u->next;
+            pool->file_count--;
+            break;
+        }
+    free(u);
+
+    return;
+}
+
+/*
+ * release_pool()
+ *
+ * Free the queue "p", which may be partly set up.
+ */
+static void release_pool(struct FLVuring_pool *p)
+{
+    if( p->sqes && p->sqes != MAP_FAILED )
+        munmap(p->sqes, p->sqes_size);
+    if( p->cq_ring && p->cq_ring != MAP_FAILED && p->cq_ring != p->sq_ring )
+        munmap(p->cq_ring, p->cq_ring_size);
+    if( p->sq_ring && p->sq_ring != MAP_FAILED )
+        munmap(p->sq_ring, p->sq_ring_size);
+    close(p->ring_fd);
+    free(p->buffers);
+    free(p);
+
+    return;
+}
+
+/*
+ * take_buffer()
+ *
+ * Find a free buffer for file "u" to fill, waiting for writes to complete
+ * if there is none. If every buffer is being filled, the fullest is
+ * written out early to free it.
+ *
+ * Returns the buffer's index, or -1 (with u->error set) on failure.
+ */
+static int take_buffer(struct FLVuring *u)
+{
+    for( ;; )
+    {
+        struct FLVuring *f, *fullest = NULL;
+        unsigned i;
+
+        for( i = 0; i < URING_BUFFERS; i++ )
+            if( !pool->owner[i] )
+            {
+                pool->owner[i] = u;
+                return i;
+            }
+        if( pool->in_flight > 0 )
+        {
+            if( submit_and_wait(1) != 0 )
+            {
+                u->error = errno;
+                return -1;
+            }
+            continue;
+        }
+        for( f = pool->files; f; f = f->next )
+            if( f->fill != -1 && (!fullest || f->fill_len > fullest->fill_len) )
+                fullest = f;
+        queue_write(fullest->fill);
+    }
+}
+
+/*
+ * queue_write()
+ *
+ * Add a write of the unwritten part of buffer "index" to the submission
+ * queue. A buffer that was being filled is first given the next offset of
+ * its file.
+ */
+static void queue_write(unsigned index)
+{
+    struct FLVuring *u = pool->owner[index];
+    unsigned tail = *pool->sq_tail, slot = tail & *pool->sq_mask;
+    struct io_uring_sqe *sqe = &pool->sqes[slot];
+
+    if( !pool->pending[index] )
+    {
+        /* Newly filled */
+        if( u->fill_len == 0 )
+        {
+            /* Nothing to write */
+            pool->owner[index] = NULL;
+            u->fill = -1;
+            return;
+        }
+        pool->pending[index] = u->fill_len;
+        pool->written[index] = 0;
+        pool->buffer_offset[index] = u->offset;
+        u->offset += (long)u->fill_len;
+        u->fill_len = 0;
+        u->fill = -1;
+        u->in_flight++;
+        pool->in_flight++;
+    }
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = u->fd;
+    sqe->off = pool->buffer_offset[index] + pool->written[index];
+    sqe->addr = (unsigned long)(pool->buffers + (size_t)index * pool->buffer_size + pool->written[index]);
+    sqe->len = pool->pending[index];
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    pool->sq_array[slot] = slot;
+    /* The entry must be visible before the kernel sees the new tail */
+    __atomic_store_n(pool->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    pool->queued++;
+
+    return;
+}
+
+/*
+ * submit_and_wait()
+ *
+ * Hand the queued writes to the kernel, waiting for at least "wait_for" of
+ * the writes in progress to complete, and process the completions.
+ *
+ * Returns 0, or -1 (with errno set) if the system call failed.
+ */
+static int submit_and_wait(unsigned wait_for)
+{
+    int ret;
+
+    do
+        ret = syscall(__NR_io_uring_enter, pool->ring_fd, pool->queued, wait_for,
+                      wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while( ret < 0 && errno == EINTR );
+    if( ret < 0 )
+        return -1;
+    pool->queued -= (unsigned)ret < pool->queued ? (unsigned)ret : pool->queued;
+    reap_completions();
+
+    return 0;
+}
+
+/*
+ * reap_completions()
+ *
+ * Process the completed writes: free their buffers, queue the rest of any
+ * short write again, and record the first error of each file.
+ */
+static void reap_completions(void)
+{
+    unsigned head = *pool->cq_head;
+
+    while( head != __atomic_load_n(pool->cq_tail, __ATOMIC_ACQUIRE) )
+    {
+        struct io_uring_cqe *cqe = &pool->cqes[head & *pool->cq_mask];
+        unsigned index = (unsigned)cqe->user_data;
+        struct FLVuring *u = pool->owner[index];
+
+        if( cqe->res > 0 && (size_t)cqe->res < pool->pending[index] )
+        {
+            pool->written[index] += cqe->res;
+            pool->pending[index] -= cqe->res;
+            queue_write(index);
+        }
+        else
+        {
+            if( cqe->res <= 0 && !u->error )
+                u->error = cqe->res < 0 ? -cqe->res : EIO;
+            pool->pending[index] = 0;
+            pool->owner[index] = NULL;
+            u->in_flight--;
+            pool->in_flight--;
+        }
+        head++;
+    }
+    __atomic_store_n(pool->cq_head, head, __ATOMIC_RELEASE);
+
+    return;
+}
+
+#else /* !HAVE_IO_URING */
+
+size_t uring_setup(size_t bytes)
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+struct FLVuring *uring_open(int fd, long offset)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+int uring_write(struct FLVuring *u, const unsigned char *data, size_t bytes)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_drain(struct FLVuring *u)
+{
+    return 0;
+}
+
+long uring_offset(const struct FLVuring *u)
+{
+    return -1;
+}
+
+long uring_completed(struct FLVuring *u)
+{
+    return -1;
+}
+
+void uring_close(struct FLVuring *u)
+{
+    return;
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+    fuzz_metadata.c
+    Fuzzing entry point for the onMetaData decoder in metadata.c, for use
+    with libFuzzer ("make fuzz") or, built with FUZZ_STANDALONE defined, as
+    a driver that runs each file named on the command line (for AFL, or for
+    replaying a crash without libFuzzer)
+    by Paul Kelly
+    Copyright (C) 2007-09 Radiomonitor Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Included rather than linked so the decoder state can be reset between
+ * inputs */
+#include "metadata.c"
+
+int LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+/*
+ * LLVMFuzzerTestOneInput()
+ *
+ * Decode the "size" bytes at "bytes" as the payload of a script tag. If any
+ * source fields were kept, the onMetaData packet generated from them must
+ * decode again with every one of our fields found.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *bytes, size_t size)
+{
+    struct FLVpacket packet, *generated;
+    struct FLVtotals totals;
+    enum meta_field field;
+
+    free(meta.extra);
+    memset(&meta, 0, sizeof(meta));
+
+    /* A copy, so reads past the end are caught however the input is held */
+    packet.type = 18;
+    packet.datasize = size;
+    packet.data = malloc(size ? size : 1);
+    packet.src = NULL;
+    memcpy(packet.data, bytes, size);
+
+    extract_metadata(&packet);
+    free(packet.data);
+
+    generated = generate_metadata_packet();
+    if( !locate_metadata(generated, &totals) )
+        abort();
+    for( field = 0; field < META_FIELDS; field++ )
+        if( meta.offset[field] == -1 )
+            abort();
+    free(generated->data);
+    free(generated);
+
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv)
+{
+    int i;
+
+    for( i = 1; i < argc; i++ )
+    {
+        FILE *in = fopen(argv[i], "rb");
+        unsigned char *buffer = NULL;
+        size_t length = 0, alloc = 0, n;
+
+        if( !in )
+        {
+            fprintf(stderr, "ERROR while opening %s: %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+        do {
+            if( length == alloc && !(buffer = realloc(buffer, alloc = alloc * 2 + 4096)) )
+            {
+                fprintf(stderr, "ERROR: Out of memory\n");
+                return 1;
+            }
+            n = fread(buffer + length, 1, alloc - length, in);
+            length += n;
+        } while( n > 0 );
+        fclose(in);
+
+        LLVMFuzzerTestOneInput(buffer, length);
+        free(buffer);
+    }
+
+    return 0;
+}
+#endif
@@ -25,64 +25,159 @@
 
 #include "flvjoin.h"
 
+/* Metadata fields written to the output, in the order they are written */
+enum meta_field
+{
+    META_DURATION, META_WIDTH, META_HEIGHT, META_FRAMERATE, META_VIDEOCODECID,
+    META_AUDIOSAMPLERATE, META_AUDIOSAMPLESIZE, META_STEREO, META_AUDIOCODECID,
+    META_FILESIZE, META_VIDEODATARATE, META_AUDIODATARATE, META_VIDEOSIZE,
+    META_AUDIOSIZE, META_DATASIZE, META_LASTTIMESTAMP, META_LASTKEYFRAMETIMESTAMP,
+    META_HASVIDEO, META_HASAUDIO, META_HASKEYFRAMES, META_FIELDS
+};
+
+/* Longest field name that may be listed in meta_fields[] */
+#define MAX_FIELD_NAME 31
+
+struct FLVmeta_field
+{
+    const char *name;
+    unsigned char name_len;
+    char boolean;    /* Encoded as a boolean rather than a double */
+    char from_input; /* Value is taken from the input files' onMetaData */
+};
+
+/* A field name and its length */
+#define FIELD(name) name, sizeof(name) - 1
+
+/* Adding a field to the output only needs an entry here and in enum meta_field */
+static const struct FLVmeta_field meta_fields[META_FIELDS] =
+{
+    [META_DURATION]        = { FIELD("duration"),        0, 0 },
+    [META_WIDTH]           = { FIELD("width"),           0, 1 },
+    [META_HEIGHT]          = { FIELD("height"),          0, 1 },
+    [META_FRAMERATE]       = { FIELD("framerate"),       0, 1 },
+    [META_VIDEOCODECID]    = { FIELD("videocodecid"),    0, 1 },
+    [META_AUDIOSAMPLERATE] = { FIELD("audiosamplerate"), 0, 1 },
+    [META_AUDIOSAMPLESIZE] = { FIELD("audiosamplesize"), 0, 1 },
+    [META_STEREO]          = { FIELD("stereo"),          1, 1 },
+    [META_AUDIOCODECID]    = { FIELD("audiocodecid"),    0, 1 },
+    [META_FILESIZE]        = { FIELD("filesize"),        0, 0 },
+    [META_VIDEODATARATE]   = { FIELD("videodatarate"),   0, 0 },
+    [META_AUDIODATARATE]   = { FIELD("audiodatarate"),   0, 0 },
+    [META_VIDEOSIZE]       = { FIELD("videosize"),       0, 0 },
+    [META_AUDIOSIZE]       = { FIELD("audiosize"),       0, 0 },
+    [META_DATASIZE]        = { FIELD("datasize"),        0, 0 },
+    [META_LASTTIMESTAMP]   = { FIELD("lasttimestamp"),   0, 0 },
+    [META_LASTKEYFRAMETIMESTAMP] = { FIELD("lastkeyframetimestamp"), 0, 0 },
+    [META_HASVIDEO]        = { FIELD("hasVideo"),        1, 0 },
+    [META_HASAUDIO]        = { FIELD("hasAudio"),        1, 0 },
+    [META_HASKEYFRAMES]    = { FIELD("hasKeyframes"),    1, 0 },
+};
+
 struct FLVmetadata
 {
-    double duration, width, height, framerate, videocodecid, audiosamplerate, audiosamplesize;
-    char stereo;
-    double audiocodecid, filesize;
-    long ofs_duration, ofs_width, ofs_height, ofs_framerate, ofs_videocodecid;
-    long ofs_audiosamplerate, ofs_audiosamplesize, ofs_stereo, ofs_audiocodecid, ofs_filesize;
+    double value[META_FIELDS];
+    long offset[META_FIELDS]; /* Where each value lies in the packet payload */
+    /* Lookup of input fields by name length: the first field with each
+     * length, and the next field with the same length as each field (-1
+     * ends the chain) */
+    signed char first_by_length[MAX_FIELD_NAME + 1];
+    signed char next_same_length[META_FIELDS];
+    char lookup_ready;
+    /* Other entries of the source onMetaData, still encoded, to be passed
+     * through to the output */
+    unsigned char *extra;
+    size_t extra_len, extra_alloc;
+    unsigned long extra_count;
+};
+
+/* Deepest nesting of AMF objects and arrays that will be decoded */
+#define MAX_AMF_DEPTH 32
+
+/* One level of nesting in the script data being decoded */
+struct AMFframe
+{
+    char named;               /* Entries are name/value pairs (object or ECMA array) */
+    unsigned long remaining;  /* Values left in a strict array */
 };
 
-static void parse_script_object(unsigned char **);
-static double parse_number(unsigned char**);
-static unsigned char *parse_script_string(unsigned char *, unsigned int, char *);
-static void add_meta_item(const char *, double);
+static int parse_script_data(const unsigned char *, size_t, long);
+static int name_is(const unsigned char *, size_t, const char *);
+static void build_field_lookup(void);
+static int find_field(const unsigned char *, size_t);
+static void add_meta_item(const unsigned char *, size_t, double);
+static void add_extra_item(const unsigned char *, size_t);
+static unsigned char *put_value(unsigned char *, enum meta_field, double);
 
 static struct FLVmetadata meta;
 
 /* 
  * put_string()
  * 
- * Encode string "string" in FLV string encoding and write it to the file stream 
- * described by "fd".
+ * Encode string "string" in FLV string encoding into the memory at "dst".
+ * Returns a pointer to the byte following the encoded string.
  */
-static void put_string(char *string, FILE *fd)
+static unsigned char *put_string(unsigned char *dst, const char *string)
 {
     unsigned short len = strlen(string);
     /* Write length as unsigned short */
-    fwrite(format_ui16(len), 2, 1, fd);
+    dst = encode_ui16(dst, len);
     /* Write string without terminating NULL-byte */
-    fwrite(string, 1, len, fd);
+    memcpy(dst, string, len);
    
-    return;
+    return dst + len;
 }
 
 /*
  * put_double()
  * 
- * Encode double-precision number "number" in FLV double encoding and write it
- * to the file stream described by "fd".
+ * Encode double-precision number "number" in FLV double encoding into the
+ * memory at "dst". Returns a pointer to the byte following the number.
  */
-static void put_double(double number, FILE *fd)
+static unsigned char *put_double(unsigned char *dst, double number)
 {
-    fputc(0, fd); /* double marker byte */
-    if(fwrite(format_double(number), sizeof(double), 1, fd) != 1)
-        fprintf(stderr, "Error writing double to file: %s\n", strerror(errno));
-   
-    return;
+    *dst++ = 0; /* double marker byte */
+    return encode_double(dst, number);
 }
 
 /*
  * put_boolean()
  * 
- * Encode the boolean value "value" in FLV boolean encoding and write it to
- * the file stream described by "fd".
+ * Encode the boolean value "value" in FLV boolean encoding into the memory
+ * at "dst". Returns a pointer to the byte following the value.
+ */
+static unsigned char *put_boolean(unsigned char *dst, char value)
+{
+    *dst++ = 1; /* boolean marker byte */
+    *dst++ = value;
+   
+    return dst;
+}
+
+/*
+ * put_value()
+ * 
+ * Encode "value" as metadata field "field" (as a double or a boolean) into
+ * the memory at "dst". Returns a pointer to the byte following the value.
+ */
+static unsigned char *put_value(unsigned char *dst, enum meta_field field, double value)
+{
+    if( meta_fields[field].boolean )
+        return put_boolean(dst, (char)value);
+    return put_double(dst, value);
+}
+
+/*
+ * patch_value()
+ * 
+ * Overwrite the encoded value of "length" bytes at "dst" in the file stream
+ * "fd" at byte offset "offset".
  */
-static void put_boolean(char value, FILE *fd)
+static void patch_value(FILE *fd, long offset, const unsigned char *dst, size_t length)
 {
-    fputc(1, fd); /* boolean marker byte */
-    fputc(value, fd);
+    fseek(fd, offset, SEEK_SET);
+    if(fwrite(dst, 1, length, fd) != length)
+        fprintf(stderr, "Error writing metadata to file: %s\n", strerror(errno));
    
     return;
 }
@@ -91,76 +186,51 @@ static void put_boolean(char value, FILE *fd)
  * generate_metadata_packet()
  * 
  * Create an FLV packet containing a Script Data Object with placeholders
- * for various metadata fields. Store the offsets of these fields within
- * the file so that we can rewind to write in the correct values before
- * closing the file.
+ * for various metadata fields, followed by any other fields passed through
+ * from the source onMetaData. Store the offsets of these fields within
+ * the payload so that we can rewind to write in the correct values before
+ * closing each file the packet is written to.
  */
-struct FLVpacket *generate_metadata_packet(FILE *fd)
+struct FLVpacket *generate_metadata_packet(void)
 {
     unsigned char variable_end[] = { 0, 0, 9 };
     char buff[255];
-    long currpos = ftell(fd) + 11; /* Take account of size of packet header */
-    long data_len;
-    unsigned char *data;
+    unsigned char *data, *pos;
     struct FLVpacket *packet = malloc(sizeof(struct FLVpacket));
+    enum meta_field field;
    
-    /* First write metadata to temporary file, then read it back in and form a proper
-     * FLVpacket with it once we know the full data size */
-   
-    FILE *tmp = tmpfile();
+    /* Serialise the metadata straight into the packet payload; each field
+     * takes at most 2 + MAX_FIELD_NAME + 9 bytes */
+    data = pos = malloc(64 + META_FIELDS * (2 + MAX_FIELD_NAME + 9) + meta.extra_len + sizeof(buff));
    
-    fputc(2, tmp); /* String object marker byte */
-    put_string("onMetaData", tmp);
-    fputc(8, tmp); /* ECMA array marker byte */
-    fwrite(format_ui32(11), 4, 1, tmp); /* our array has 11 items */
-    put_string("duration", tmp);
-    meta.ofs_duration = currpos + ftell(tmp); /* save location to write to for later */
-    put_double(0, tmp);
-    put_string("width", tmp);
-    meta.ofs_width = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("height", tmp);
-    meta.ofs_height = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("framerate", tmp);
-    meta.ofs_framerate = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("videocodecid", tmp);
-    meta.ofs_videocodecid = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("audiosamplerate", tmp);
-    meta.ofs_audiosamplerate = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("audiosamplesize", tmp);
-    meta.ofs_audiosamplesize = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("stereo", tmp);
-    meta.ofs_stereo = currpos + ftell(tmp);
-    put_boolean(0, tmp);
-    put_string("audiocodecid", tmp);
-    meta.ofs_audiocodecid = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("filesize", tmp);
-    meta.ofs_filesize = currpos + ftell(tmp);
-    put_double(0, tmp);
-    put_string("metadatacreator", tmp);
+    *pos++ = 2; /* String object marker byte */
+    pos = put_string(pos, "onMetaData");
+    *pos++ = 8; /* ECMA array marker byte */
+    /* Our fields, the source's other fields and metadatacreator */
+    pos = encode_ui32(pos, META_FIELDS + meta.extra_count + 1);
+    for( field = 0; field < META_FIELDS; field++ )
+    {
+        pos = put_string(pos, meta_fields[field].name);
+        meta.offset[field] = pos - data; /* save location to write to for later */
+        pos = put_value(pos, field, 0);
+    }
+    if( meta.extra_len > 0 )
+        memcpy(pos, meta.extra, meta.extra_len);
+    pos += meta.extra_len;
+    pos = put_string(pos, "metadatacreator");
     sprintf(buff, "%s v%s", PROG_NAME, PROG_VERSION);
-    fputc(2, tmp); /* String object marker byte */
-    put_string(buff, tmp);
-    fwrite(variable_end, 1, 3, tmp);
-   
-    data_len = ftell(tmp);
-    data = malloc(data_len);
-    rewind(tmp);
-    fread(data, 1, data_len, tmp);
-    fclose(tmp);
+    *pos++ = 2; /* String object marker byte */
+    pos = put_string(pos, buff);
+    memcpy(pos, variable_end, 3);
+    pos += 3;
    
     packet->type = 18; /* Script data object */
-    packet->datasize = data_len;
+    packet->datasize = pos - data;
     packet->timestamp = 0;
     packet->streamid = 0;
     packet->data = data;
-    packet->backptr = data_len + 11;
+    packet->backptr = packet->datasize + 11;
+    packet->src = NULL;
    
     return packet;
 }
@@ -174,31 +244,8 @@ struct FLVpacket *generate_metadata_packet(FILE *fd)
  */
 int extract_metadata(struct FLVpacket *packet)
 {
-    unsigned char *pos = packet->data;
-    unsigned char marker;
-    int found_metadata_marker = 0;
-
     if(packet->type != 18) /* Script Data Object */
         return 0;
-   
-    marker = *(pos++);
-    if( marker != 2 )
-        /* Script Object Marker Byte missing */
-        pos--;
-
-    /* Check for onMetaData object name; non-watertight check
-     * for buffer over-run */
-    while(pos - packet->data <= packet->datasize - 6)
-    {	
-        char buff[1024];
-        double val;
-
-        pos = parse_script_string(pos + 2, conv_ui16(pos), buff);
-        if(strcmp(buff, "onMetaData") == 0)
-            found_metadata_marker = 1;
-        val = parse_number(&pos);
-        add_meta_item(buff, val);
-    }
 
     /* If we don't find an "onMetaData" string we've still processed and populated
      * our meta object with any valid tags found, however any later script object
@@ -206,203 +253,382 @@ int extract_metadata(struct FLVpacket *packet)
      * string anywhere, then we'll consider this the definitive metadata and will
      * not process any further script data object packets. */
 
-    return found_metadata_marker;
+    return parse_script_data(packet->data, packet->datasize, -1);
+}
+
+/*
+ * locate_metadata()
+ * 
+ * Find our fields in the metadata packet "packet" of an existing output
+ * file, so that write_metadata() can update them in place. The totals written there are
+ * recovered into "totals", so they can be carried on from.
+ * 
+ * Returns 1 if the packet holds an onMetaData object, otherwise 0.
+ */
+int locate_metadata(struct FLVpacket *packet, struct FLVtotals *totals)
+{
+    enum meta_field field;
+    double duration;
+
+    for( field = 0; field < META_FIELDS; field++ )
+        meta.offset[field] = -1;
+    if( packet->type != 18 || !parse_script_data(packet->data, packet->datasize, 0) )
+        return 0;
+
+    for( field = 0; field < META_FIELDS; field++ )
+        if( meta.offset[field] == -1 )
+            fprintf(stderr, "WARNING: Metadata field %s not found in output; it won't be updated\n",
+                    meta_fields[field].name);
+
+    /* Payload byte totals are only recorded as data rates */
+    duration = meta.value[META_DURATION];
+    totals->video_bytes = (unsigned long long)(0.5 + meta.value[META_VIDEODATARATE] * duration * 1000 / 8);
+    totals->audio_bytes = (unsigned long long)(0.5 + meta.value[META_AUDIODATARATE] * duration * 1000 / 8);
+    totals->video_size = (unsigned long long)meta.value[META_VIDEOSIZE];
+    totals->audio_size = (unsigned long long)meta.value[META_AUDIOSIZE];
+    totals->data_size = (unsigned long long)meta.value[META_DATASIZE];
+    totals->video_tags = meta.value[META_HASVIDEO] != 0;
+    totals->audio_tags = meta.value[META_HASAUDIO] != 0;
+    if( meta.value[META_HASKEYFRAMES] != 0 )
+        totals->last_keyframe_timestamp = (long)(0.5 + meta.value[META_LASTKEYFRAMETIMESTAMP] * 1000);
+
+    return 1;
 }
 
 /*
  * add_meta_item()
  * 
- * Check a string pair/value combination, and if the string corresponds
- * to one of a specified set of metadata fields, store the value in
- * extern struct "meta".
+ * Check a name/value combination, where the name is the "len" bytes at
+ * "name" (not NULL-terminated), and if the name corresponds to one of a
+ * specified set of metadata fields, store the value in extern struct "meta".
  */
-static void add_meta_item(const char *name, double value)
+static void add_meta_item(const unsigned char *name, size_t len, double value)
 {
-    if(value == -1)
-        return;
-    if(strcmp(name, "width") == 0)
-        meta.width = value;
-    else if(strcmp(name, "height") == 0)
-        meta.height = value;
-    else if(strcmp(name, "framerate") == 0)
-        meta.framerate = value;
-    else if(strcmp(name, "videocodecid") == 0)
-        meta.videocodecid = value;
-    else if(strcmp(name, "audiosamplerate") == 0)
-        meta.audiosamplerate = value;
-    else if(strcmp(name, "audiosamplesize") == 0)
-        meta.audiosamplesize = value;
-    else if(strcmp(name, "stereo") == 0)
-        meta.stereo = (char)value;
-    else if(strcmp(name, "audiocodecid") == 0)
-        meta.audiocodecid = value;
+    int field = find_field(name, len);
+
+    if( field != -1 && meta_fields[field].from_input )
+        meta.value[field] = meta_fields[field].boolean ? (char)value : value;
 
     return;
 }
 
 /*
- * write_metadata()
+ * find_field()
  * 
- * Calculate duration and filesize based on the timestamp and file descriptor
- * passed, and write the contents of extern struct "meta" to the file at the
- * byte offsets that were stored by generate_metadata_packet().
+ * Look up the name of "len" bytes at "name" in meta_fields[]. Only fields
+ * with the same name length are compared.
+ * 
+ * Returns the field, or -1 if the name isn't one of ours.
  */
-void write_metadata(FILE *fd, unsigned int timestamp)
+static int find_field(const unsigned char *name, size_t len)
 {
-    meta.duration = (double)timestamp / 1000;
-    meta.filesize = (double)ftell(fd);
-
-    fseek(fd, meta.ofs_duration, SEEK_SET);
-    put_double(meta.duration, fd);
-    fseek(fd, meta.ofs_width, SEEK_SET);
-    put_double(meta.width, fd);
-    fseek(fd, meta.ofs_height, SEEK_SET);
-    put_double(meta.height, fd);
-    fseek(fd, meta.ofs_framerate, SEEK_SET);
-    put_double(meta.framerate, fd);
-    fseek(fd, meta.ofs_videocodecid, SEEK_SET);
-    put_double(meta.videocodecid, fd);
-    fseek(fd, meta.ofs_audiosamplerate, SEEK_SET);
-    put_double(meta.audiosamplerate, fd);
-    fseek(fd, meta.ofs_audiosamplesize, SEEK_SET);
-    put_double(meta.audiosamplesize, fd);
-    fseek(fd, meta.ofs_stereo, SEEK_SET);
-    put_boolean(meta.stereo, fd);
-    fseek(fd, meta.ofs_audiocodecid, SEEK_SET);
-    put_double(meta.audiocodecid, fd);
-    fseek(fd, meta.ofs_filesize, SEEK_SET);
-    put_double(meta.filesize, fd);
+    int field;
 
-    return;
+    if( !meta.lookup_ready )
+        build_field_lookup();
+    if( len > MAX_FIELD_NAME )
+        return -1;
+    for( field = meta.first_by_length[len]; field != -1; field = meta.next_same_length[field] )
+        if( memcmp(name, meta_fields[field].name, len) == 0 )
+            return field;
+
+    return -1;
 }
 
 /*
- * parse_script_object()
+ * add_extra_item()
  * 
- * Parse an FLV script object and save it as metadata if a relevant name/value
- * combination is found.
- * Update position pointer "pos" to point to the next piece of data after
- * the object.
+ * Keep the encoded onMetaData entry (name and value) of "len" bytes at
+ * "entry", to be copied into the output metadata.
  */
-static void parse_script_object(unsigned char **pos)
+static void add_extra_item(const unsigned char *entry, size_t len)
 {
-    unsigned char marker = *(*pos)++;
-    unsigned char variable_end[] = { 0, 0, 9 };
-    char buff[1024];
-    double val;
+    if( meta.extra_len + len > meta.extra_alloc )
+    {
+        meta.extra_alloc = (meta.extra_len + len) * 2;
+        if( !(meta.extra = realloc(meta.extra, meta.extra_alloc)) )
+        {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(meta.extra + meta.extra_len, entry, len);
+    meta.extra_len += len;
+    meta.extra_count++;
 
-    if( marker != 2 )
-        /* Script Object Marker Byte missing */
-        (*pos)--;
+    return;
+}
 
-    *pos = parse_script_string(*pos + 2, conv_ui16(*pos), buff);
-    val = parse_number(pos);
-    add_meta_item(buff, val);
+/*
+ * build_field_lookup()
+ * 
+ * Chain together the fields in meta_fields[] with names of the same length,
+ * so find_field() only compares a name with fields of its length.
+ */
+static void build_field_lookup(void)
+{
+    int field;
 
-    if( memcmp(*pos, variable_end, 3) == 0 )
-	/* Skip over closing bytes if present */
-        *pos += 3;
+    memset(meta.first_by_length, -1, sizeof(meta.first_by_length));
+    for( field = META_FIELDS - 1; field >= 0; field-- )
+    {
+        meta.next_same_length[field] = meta.first_by_length[meta_fields[field].name_len];
+        meta.first_by_length[meta_fields[field].name_len] = field;
+    }
+    meta.lookup_ready = 1;
 
     return;
 }
 
 /*
- * parse_number
+ * write_metadata()
  * 
- * Parse an FLV script variable and return a double-precision number if
- * a numerical value was able to be extracted, otherwise return -1.
- * If any name/value combinations are extracted, save them as metadata if
- * appropriate.
- * Update position pointer "pos" to point to the next piece of data after
- * the variable.
+ * Calculate duration and filesize based on the timestamp and file descriptor
+ * passed, and the data rates, sizes and last timestamps from the totals
+ * "totals" of what was written, and write the contents of extern struct
+ * "meta" to the metadata packet whose payload starts at byte offset "base"
+ * of the file, at the offsets that were stored by generate_metadata_packet().
  */
-static double parse_number(unsigned char **pos)
-{  
-    unsigned char variable_type = *(*pos)++;
-    double value = -1;
+void write_metadata(FILE *fd, long base, unsigned int timestamp, const struct FLVtotals *totals)
+{
+    unsigned char value[9];
+    enum meta_field field;
+    double duration = (double)timestamp / 1000;
 
-    switch( variable_type )
+    meta.value[META_DURATION] = duration;
+    meta.value[META_FILESIZE] = (double)ftell(fd);
+    if( duration > 0 )
     {
-        case 0: /* double */
-            value = conv_double(*pos);
-            *pos += sizeof(double);
-            break;
-        case 1: /* boolean */
-            value = (double)**pos;
-            (*pos)++;
-            break;
-        case 2: /* string */
-            *pos = parse_script_string(*pos + 2, conv_ui16(*pos), NULL);
-            break;
-        case 3: /* entire script object */
-            parse_script_object(pos);
-            break;
-        case 7: /* reference */
-            value = conv_ui16(*pos);
-            *pos += 2;
-            break;
-        case 8: /* ECMA array */
-	    {
-	        int array_length = conv_ui32(*pos);
-		int count;
-		       
-		*pos += 4;
-		for( count = 0; count < array_length; count++ )
-		{
-	            char buff[1024];
-		    double val;
-
-		    *pos = parse_script_string(*pos + 2, conv_ui16(*pos), buff);
-		    val = parse_number(pos);
-                    add_meta_item(buff, val);
-		}		       
-	    }
-            break;
-        case 10: /* script array */
-	    {
-	        int array_length = conv_ui32(*pos);
-		int count;
-		       
-		*pos += 4;
-		for( count = 0; count < array_length; count++ )
-		    value = parse_number(pos);
-	    }
-            break;
-        case 11: /* date */
-            value = conv_double(*pos) / 1000; /* value is millisecs since epoch */
-	    *pos += sizeof(double);
-	    *pos += 2; /* TZ offset */
-            break;
-        case 12: /* long string */
-            *pos = parse_script_string(*pos + 2, conv_ui32(*pos), NULL);
-            break;
-        default: /* unhandled; will probably result in corruption */
-            fprintf(stderr, "WARNING: Unhandled script variable type %d\n", variable_type);
-            break;
-   }
+        /* In kilobits per second */
+        meta.value[META_VIDEODATARATE] = totals->video_bytes * 8 / 1000.0 / duration;
+        meta.value[META_AUDIODATARATE] = totals->audio_bytes * 8 / 1000.0 / duration;
+    }
+    meta.value[META_VIDEOSIZE] = (double)totals->video_size;
+    meta.value[META_AUDIOSIZE] = (double)totals->audio_size;
+    meta.value[META_DATASIZE] = (double)totals->data_size;
+    if( totals->last_timestamp >= 0 )
+        meta.value[META_LASTTIMESTAMP] = totals->last_timestamp / 1000.0;
+    if( totals->last_keyframe_timestamp >= 0 )
+        meta.value[META_LASTKEYFRAMETIMESTAMP] = totals->last_keyframe_timestamp / 1000.0;
+    meta.value[META_HASVIDEO] = totals->video_tags > 0;
+    meta.value[META_HASAUDIO] = totals->audio_tags > 0;
+    meta.value[META_HASKEYFRAMES] = totals->last_keyframe_timestamp >= 0;
+
+    for( field = 0; field < META_FIELDS; field++ )
+        if( meta.offset[field] != -1 )
+            patch_value(fd, base + meta.offset[field], value, put_value(value, field, meta.value[field]) - value);
 
-    return value;
+    return;
 }
 
 /*
- * parse_script_string()
+ * parse_script_data()
  * 
- * Decode an FLV string object and store the decoded string in buffer "buff"
- * (buff may be NULL; in which case the decoded string is not saved). Update
- * position pointer "pos" to point to the next piece of data after the string.
+ * Decode the "len" bytes of AMF0 script data at "data", passing each named
+ * number, boolean, reference or date found (at any depth) to add_meta_item().
+ * The data is treated as a sequence of name/value pairs, as in an onMetaData
+ * tag (a string followed by an ECMA array). Nested objects and arrays are
+ * tracked on an explicit stack no more than MAX_AMF_DEPTH deep rather than
+ * by recursion, every read is checked against the end of the data, and
+ * names are compared where they lie without being copied, so malformed or
+ * hostile data can at worst end the decoding early.
+ * Entries of an onMetaData object other than the fields we write ourselves
+ * (and the stale keyframe index) are kept with add_extra_item().
+ * If "locate_base" isn't -1 the data is our own metadata, read back from
+ * the output: instead, the value of each of our fields in the onMetaData
+ * object and its offset in the data (plus "locate_base") are stored in
+ * "meta".
+ * 
+ * Returns 1 if a top-level "onMetaData" name was found, otherwise 0.
  */
-static unsigned char *parse_script_string(unsigned char *pos, unsigned int string_length, char *buff)
-{   
-    if(buff)
+static int parse_script_data(const unsigned char *data, size_t len, long locate_base)
+{
+    struct AMFframe stack[MAX_AMF_DEPTH];
+    const unsigned char *pos = data, *end = data + len;
+    const unsigned char *entry = NULL; /* Start of an onMetaData entry to keep */
+    int depth = 0, found_metadata_marker = 0, in_metadata = 0, field = -1;
+
+    /* The top level holds name/value pairs with no end marker */
+    stack[0].named = 1;
+    stack[0].remaining = 0;
+
+    for( ;; )
     {
-        unsigned int count;
-        for( count = 0; count < string_length; count++)
-            buff[count] = (char)pos[count];
-        buff[count] = '\0';
+        const unsigned char *name = NULL;
+        size_t name_len = 0, skip = 0;
+        int have_value = 0;
+        double value = 0;
+        unsigned char type;
+
+        if( entry && depth == 1 )
+        {
+            /* The entry's value is complete */
+            add_extra_item(entry, pos - entry);
+            entry = NULL;
+        }
+
+        if( stack[depth].named )
+        {
+            if( depth == 0 && pos < end && *pos == 2 )
+                pos++; /* Script Object Marker Byte before a top-level name */
+            if( end - pos < 2 )
+                break;
+            name_len = conv_ui16(pos);
+            if( name_len == 0 && end - pos >= 3 && pos[2] == 9 )
+            {
+                /* Object end marker */
+                pos += 3;
+                if( depth == 0 )
+                    continue;
+                depth--;
+                continue;
+            }
+            if( (size_t)(end - pos) - 2 < name_len )
+                break;
+            name = pos + 2;
+            pos += 2 + name_len;
+            if( depth == 0 )
+            {
+                in_metadata = name_is(name, name_len, "onMetaData");
+                if( in_metadata )
+                    found_metadata_marker = 1;
+            }
+            else if( depth == 1 && in_metadata )
+            {
+                field = find_field(name, name_len);
+                if( field == -1 && locate_base == -1 &&
+                    !name_is(name, name_len, "metadatacreator") &&
+                    !name_is(name, name_len, "keyframes") )
+                    entry = name - 2;
+            }
+        }
+        else
+        {
+            if( stack[depth].remaining == 0 )
+            {
+                depth--;
+                continue;
+            }
+            stack[depth].remaining--;
+        }
+
+        if( pos >= end )
+            break;
+        type = *pos++;
+
+        switch( type )
+        {
+            case 0: /* double */
+                if( end - pos < 8 )
+                    goto truncated;
+                value = conv_double(pos);
+                have_value = 1;
+                skip = 8;
+                break;
+            case 1: /* boolean */
+                if( end - pos < 1 )
+                    goto truncated;
+                value = (double)*pos;
+                have_value = 1;
+                skip = 1;
+                break;
+            case 2: /* string */
+                if( end - pos < 2 )
+                    goto truncated;
+                skip = 2 + (size_t)conv_ui16(pos);
+                break;
+            case 3: /* script object */
+            case 8: /* ECMA array; the length is only a hint, so read up to the end marker */
+            case 16: /* typed object; skip the class name */
+                if( type == 8 )
+                    skip = 4;
+                else if( type == 16 )
+                {
+                    if( end - pos < 2 )
+                        goto truncated;
+                    skip = 2 + (size_t)conv_ui16(pos);
+                }
+                if( depth + 1 >= MAX_AMF_DEPTH )
+                {
+                    fprintf(stderr, "WARNING: Script data nested too deeply\n");
+                    return found_metadata_marker;
+                }
+                depth++;
+                stack[depth].named = 1;
+                stack[depth].remaining = 0;
+                break;
+            case 5: /* null */
+            case 6: /* undefined */
+                break;
+            case 7: /* reference */
+                if( end - pos < 2 )
+                    goto truncated;
+                value = conv_ui16(pos);
+                have_value = 1;
+                skip = 2;
+                break;
+            case 10: /* strict array */
+                if( end - pos < 4 )
+                    goto truncated;
+                if( depth + 1 >= MAX_AMF_DEPTH )
+                {
+                    fprintf(stderr, "WARNING: Script data nested too deeply\n");
+                    return found_metadata_marker;
+                }
+                depth++;
+                stack[depth].named = 0;
+                /* Every value takes at least one byte, so a bogus count
+                 * can't keep the loop going past the end of the data */
+                stack[depth].remaining = conv_ui32(pos);
+                skip = 4;
+                break;
+            case 11: /* date */
+                if( end - pos < 10 )
+                    goto truncated;
+                value = conv_double(pos) / 1000; /* value is millisecs since epoch */
+                have_value = 1;
+                skip = 10; /* Includes TZ offset */
+                break;
+            case 12: /* long string */
+                if( end - pos < 4 )
+                    goto truncated;
+                skip = 4 + (size_t)conv_ui32(pos);
+                break;
+            default: /* unhandled; its length is unknown so nothing after it can be read */
+                fprintf(stderr, "WARNING: Unhandled script variable type %d\n", type);
+                return found_metadata_marker;
+        }
+        if( (size_t)(end - pos) < skip )
+            goto truncated;
+        pos += skip;
+
+        if( locate_base != -1 )
+        {
+            /* Only values encoded the way we write them can be rewritten */
+            if( name && depth == 1 && field != -1 && type == (meta_fields[field].boolean ? 1 : 0) )
+            {
+                meta.offset[field] = locate_base + (pos - skip - 1 - data);
+                meta.value[field] = value;
+            }
+        }
+        else if( name && have_value )
+            add_meta_item(name, name_len, value);
     }
-	       
-    pos += string_length;
-   
-    return pos;
+
+    return found_metadata_marker;
+
+truncated:
+    fprintf(stderr, "WARNING: Script data truncated\n");
+    return found_metadata_marker;
 }
 
+/*
+ * name_is()
+ * 
+ * Returns nonzero if the "len" bytes at "name" are the same as the string
+ * "field".
+ */
+static int name_is(const unsigned char *name, size_t len, const char *field)
+{
+    return len == strlen(field) && memcmp(name, field, len) == 0;
+}